@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "rle.h"
+#include "rope.h"
+#include "mrope.h"
+#include "rld0.h"
+#include "mtgz.h"
+#include "kseq.h"
+KSEQ_INIT(mtgz_t*, mtgz_read)
+
+#define BM_MAX_SET 16
+
+static unsigned char seq_nt6_table[128] = {
+    0, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,
+    5, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,
+    5, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,
+    5, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,
+    5, 1, 5, 2,  5, 5, 5, 3,  5, 5, 5, 5,  5, 5, 5, 5,
+    5, 5, 5, 5,  4, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5,
+    5, 1, 5, 2,  5, 5, 5, 3,  5, 5, 5, 5,  5, 5, 5, 5,
+    5, 5, 5, 5,  4, 5, 5, 5,  5, 5, 5, 5,  5, 5, 5, 5
+};
+
+static double realtime()
+{
+	struct timeval tp;
+	struct timezone tzp;
+	gettimeofday(&tp, &tzp);
+	return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+static long peakrss() // in kB on Linux
+{
+	struct rusage r;
+	getrusage(RUSAGE_SELF, &r);
+	return r.ru_maxrss;
+}
+
+static volatile int64_t bm_sink; // results of query loops are stored here to keep the loops from being optimized away
+
+static inline uint64_t bm_rand(uint64_t *x) // splitmix64
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ z >> 27) * 0x94d049bb133111ebULL;
+	return z ^ z >> 31;
+}
+
+static int64_t parse_size(const char *s)
+{
+	double x;
+	char *p;
+	x = strtod(s, &p);
+	if (*p == 'K' || *p == 'k') x *= 1024;
+	else if (*p == 'M' || *p == 'm') x *= 1024 * 1024;
+	else if (*p == 'G' || *p == 'g') x *= 1024 * 1024 * 1024;
+	return (int64_t)(x + .499);
+}
+
+static int parse_list(const char *s, int *a) // comma-separated integers
+{
+	int n = 0, x;
+	char *p;
+	while (*s && n < BM_MAX_SET) {
+		x = strtol(s, &p, 10);
+		if (p == s) break;
+		a[n++] = x;
+		s = *p == ','? p + 1 : p;
+	}
+	return n;
+}
+
+/**********************
+ *** Input data set ***
+ **********************/
+
+typedef struct {
+	char *name;
+	int64_t l, n; // total length including the NULs, and number of strings
+	uint8_t *s; // concatenated, NULL delimited, reversed strings, as taken by mr_insert_multi()
+	int64_t m;
+} bmdata_t;
+
+static void bm_push(bmdata_t *d, int l, const uint8_t *s) // add a string and its reverse complement
+{
+	int i;
+	uint8_t *p;
+	if (d->l + 2 * (l + 1) > d->m) {
+		d->m = d->l + 2 * (l + 1);
+		d->m += d->m >> 1;
+		d->s = (uint8_t*)realloc(d->s, d->m);
+	}
+	for (i = 0, p = d->s + d->l; i < l; ++i) *p++ = s[l-1-i];
+	*p++ = 0;
+	for (i = 0; i < l; ++i) *p++ = s[i] >= 1 && s[i] <= 4? 5 - s[i] : s[i];
+	*p++ = 0;
+	d->l += 2 * (l + 1), d->n += 2;
+}
+
+static void bm_synthetic(bmdata_t *d, int64_t n_syms, int rlen, uint64_t seed) // reads at 20X coverage from a random genome, with 1% errors
+{
+	int64_t i, glen;
+	uint8_t *g, *r;
+	char name[64];
+	glen = n_syms / 40 > rlen * 2? n_syms / 40 : rlen * 2;
+	g = (uint8_t*)malloc(glen);
+	r = (uint8_t*)malloc(rlen);
+	for (i = 0; i < glen; ++i) g[i] = 1 + bm_rand(&seed) % 4;
+	while (d->l < n_syms) {
+		int64_t x = bm_rand(&seed) % (glen - rlen + 1);
+		for (i = 0; i < rlen; ++i) {
+			uint64_t z = bm_rand(&seed);
+			r[i] = z % 100 == 0? 1 + (g[x+i] + (z>>8) % 3) % 4 : g[x+i];
+		}
+		bm_push(d, rlen, r);
+	}
+	free(g); free(r);
+	snprintf(name, 64, "synthetic-%d", rlen);
+	d->name = strdup(name);
+}
+
+static int bm_read(bmdata_t *d, const char *fn, int64_t n_syms)
+{
+	mtgz_t *fp;
+	kseq_t *ks;
+	if ((fp = mtgz_open(fn, 1)) == 0) {
+		fprintf(stderr, "[E::%s] failed to open file '%s'\n", __func__, fn);
+		return -1;
+	}
+	ks = kseq_init(fp);
+	while (d->l < n_syms && kseq_read(ks) >= 0) {
+		int i;
+		uint8_t *s = (uint8_t*)ks->seq.s;
+		for (i = 0; i < ks->seq.l; ++i)
+			s[i] = s[i] < 128? seq_nt6_table[s[i]] : 5;
+		bm_push(d, ks->seq.l, s);
+	}
+	kseq_destroy(ks);
+	mtgz_close(fp);
+	d->name = strdup(fn);
+	return 0;
+}
+
+/***************************
+ *** Timers and counters ***
+ ***************************/
+
+typedef struct {
+	const char *data;
+	int max_nodes, block_len; // $max_nodes is 0 for leaf kernels
+	int fd; // perf event counting cache misses; -1 if unavailable
+	double t;
+	uint64_t cm;
+} bmtimer_t;
+
+static void bm_perf_open(bmtimer_t *t)
+{
+	t->fd = -1;
+#ifdef __linux__
+	{
+		struct perf_event_attr a;
+		memset(&a, 0, sizeof(a));
+		a.size = sizeof(a);
+		a.type = PERF_TYPE_HARDWARE;
+		a.config = PERF_COUNT_HW_CACHE_MISSES;
+		a.disabled = 1, a.exclude_kernel = 1, a.exclude_hv = 1;
+		a.inherit = 1; // include worker threads, which are counted when they are joined
+		t->fd = syscall(__NR_perf_event_open, &a, 0, -1, -1, 0);
+	}
+#endif
+}
+
+static void bm_start(bmtimer_t *t)
+{
+#ifdef __linux__
+	if (t->fd >= 0) ioctl(t->fd, PERF_EVENT_IOC_RESET, 0), ioctl(t->fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	t->t = realtime();
+}
+
+static void bm_stop(bmtimer_t *t, const char *kernel, int64_t n_ops, int64_t n_syms)
+{
+	double t_used = realtime() - t->t;
+	t->cm = (uint64_t)-1;
+#ifdef __linux__
+	if (t->fd >= 0) {
+		ioctl(t->fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(t->fd, &t->cm, 8) != 8) t->cm = (uint64_t)-1;
+	}
+#endif
+	if (t_used <= 0.) t_used = 1e-9;
+	printf("%s\t%s\t%d\t%d\t%ld\t%.2f\t%.4g\t", kernel, t->data, t->max_nodes, t->block_len, (long)n_ops, t_used * 1e9 / n_ops, n_syms / t_used);
+	if (t->cm != (uint64_t)-1) printf("%.3f", (double)t->cm / n_ops);
+	else printf("NA");
+	printf("\t%ld\n", peakrss());
+	fflush(stdout);
+}
+
+/***************
+ *** Kernels ***
+ ***************/
+
+#define BM_RLE_INS  0x1
+#define BM_RLE_RANK 0x2
+#define BM_ROPE_INS 0x4
+#define BM_ROPE_RANK 0x8
+#define BM_MR_INS1  0x10
+#define BM_MR_MULTI 0x20
+#define BM_MR_RANK  0x40
+#define BM_FRZ_RANK 0x80
+#define BM_RLD_RANK 0x100
+
+static const char *bm_kernels[] = { "rle_insert_cached", "rle_rank2a", "rope_insert_run", "rope_rank2a", "mr_insert1", "mr_insert_multi", "mr_rank2a", "mr_frz_rank2a", "rld_rank2a", 0 };
+
+static inline int bm_sym(const bmdata_t *d, int64_t *k) // the next symbol in the data set, wrapping around
+{
+	int a;
+	if (*k >= d->l) *k = 0;
+	a = d->s[(*k)++];
+	return a;
+}
+
+static void bm_block_reset(uint8_t *b, int block_len, int ck_len, int64_t ec[6])
+{
+	memset(b, 0, block_len);
+	memset(ec, 0, 48);
+	if (ck_len) rle_ck_build(b, ck_len);
+}
+
+static void bm_rle(bmtimer_t *t, const bmdata_t *d, int flag, int64_t n_ops, uint64_t seed)
+{
+	int ck_len = rle_ck_n(t->block_len)? t->block_len : 0, max_runs = t->block_len - rle_ck_size(ck_len) - RLE_MIN_SPACE;
+	int64_t i, k = 0, ec[6], cnt[6], tot = 0;
+	uint8_t *b;
+	b = (uint8_t*)calloc(t->block_len, 1);
+	if (flag & BM_RLE_INS) { // fill a block with symbols at random positions; start over when it is full
+		int beg = 0;
+		int64_t bc[6];
+		bm_block_reset(b, t->block_len, ck_len, ec);
+		memset(bc, 0, 48);
+		bm_start(t);
+		for (i = 0; i < n_ops; ++i) {
+			int a = bm_sym(d, &k), n_runs;
+			n_runs = rle_insert_cached(b, ck_len, bm_rand(&seed) % (tot + 1), a, 1, cnt, ec, &beg, bc);
+			++ec[a], ++tot;
+			if (n_runs > max_runs) {
+				bm_block_reset(b, t->block_len, ck_len, ec);
+				beg = 0, tot = 0, memset(bc, 0, 48);
+			}
+		}
+		bm_stop(t, "rle_insert_cached", n_ops, n_ops);
+	}
+	if (flag & BM_RLE_RANK) { // rank of random short intervals in one full block
+		int64_t cx[6], cy[6], sum = 0;
+		bm_block_reset(b, t->block_len, ck_len, ec);
+		for (tot = 0;; ++tot) {
+			int a = bm_sym(d, &k);
+			if (rle_insert(b, ck_len, bm_rand(&seed) % (tot + 1), a, 1, cnt, ec) > max_runs) break;
+			++ec[a];
+		}
+		++ec[d->s[k-1]], ++tot;
+		bm_start(t);
+		for (i = 0; i < n_ops; ++i) {
+			int64_t x = bm_rand(&seed) % (tot + 1), y = x + (i & 63);
+			memset(cx, 0, 48), memset(cy, 0, 48); // rle_rank2a() adds to $cx and $cy
+			rle_rank2a(b, ck_len, x, y < tot? y : tot, cx, cy, ec);
+			sum += cx[i%6] + cy[i%6];
+		}
+		bm_stop(t, "rle_rank2a", n_ops, n_ops);
+		bm_sink = sum;
+	}
+	free(b);
+}
+
+static void bm_rope(bmtimer_t *t, const bmdata_t *d, int flag, int64_t n_ops, uint64_t seed)
+{
+	int64_t i, k = 0, n_ins = d->l;
+	rope_t *r;
+	rpcache_t cache;
+	r = rope_init(t->max_nodes, t->block_len);
+	memset(&cache, 0, sizeof(rpcache_t));
+	bm_start(t);
+	for (i = 0; i < n_ins; ++i) // as many symbols as in the data set, at random positions
+		rope_insert_run(r, bm_rand(&seed) % (i + 1), bm_sym(d, &k), 1, &cache);
+	if (flag & BM_ROPE_INS) bm_stop(t, "rope_insert_run", n_ins, n_ins);
+	if (flag & BM_ROPE_RANK) {
+		int64_t cx[6], cy[6], sum = 0;
+		bm_start(t);
+		for (i = 0; i < n_ops; ++i) {
+			int64_t x = bm_rand(&seed) % (n_ins + 1), y = x + (i & 63);
+			rope_rank2a(r, x, y < n_ins? y : n_ins, cx, cy);
+			sum += cx[i%6] + cy[i%6];
+		}
+		bm_stop(t, "rope_rank2a", n_ops, n_ops);
+		bm_sink = sum;
+	}
+	rope_destroy(r);
+}
+
+static void bm_mrope(bmtimer_t *t, const bmdata_t *d, int flag, int n_threads)
+{
+	mrope_t *mr;
+	if (flag & BM_MR_INS1) {
+		int64_t k;
+		mr = mr_init(t->max_nodes, t->block_len, MR_SO_IO);
+		bm_start(t);
+		for (k = 0; k < d->l; k += strlen((char*)d->s + k) + 1)
+			mr_insert1(mr, d->s + k);
+		bm_stop(t, "mr_insert1", d->n, d->l);
+		mr_destroy(mr);
+	}
+	if (flag & BM_MR_MULTI) {
+		mr = mr_init(t->max_nodes, t->block_len, MR_SO_IO);
+		bm_start(t);
+		mr_insert_multi(mr, d->l, d->s, n_threads);
+		bm_stop(t, "mr_insert_multi", d->n, d->l);
+		mr_destroy(mr);
+	}
+}
+
+static void bm_query(bmtimer_t *t, const bmdata_t *d, int flag, int64_t n_ops, int n_threads, uint64_t seed)
+{ // rank of random short intervals in the whole index, on the rope, frozen and FMD representations
+	int64_t i, tot, sum = 0;
+	mrope_t *mr;
+	mr = mr_init(t->max_nodes, t->block_len, MR_SO_RLO);
+	mr_insert_multi(mr, d->l, d->s, n_threads);
+	tot = mr_get_tot(mr);
+	if (flag & BM_MR_RANK) {
+		int64_t cx[6], cy[6];
+		uint64_t s = seed;
+		bm_start(t);
+		for (i = 0; i < n_ops; ++i) {
+			int64_t x = bm_rand(&s) % (tot + 1), y = x + (i & 63);
+			mr_rank2a(mr, x, y < tot? y : tot, cx, cy);
+			sum += cx[i%6] + cy[i%6];
+		}
+		bm_stop(t, "mr_rank2a", n_ops, n_ops);
+	}
+	if (flag & BM_FRZ_RANK) {
+		int64_t cx[6], cy[6];
+		uint64_t s = seed;
+		mrfrz_t *f;
+		f = mr_freeze(mr);
+		bm_start(t);
+		for (i = 0; i < n_ops; ++i) {
+			int64_t x = bm_rand(&s) % (tot + 1), y = x + (i & 63);
+			mr_frz_rank2a(f, x, y < tot? y : tot, cx, cy);
+			sum += cx[i%6] + cy[i%6];
+		}
+		bm_stop(t, "mr_frz_rank2a", n_ops, n_ops);
+		mr_frz_destroy(f);
+	}
+	if (flag & BM_RLD_RANK) {
+		uint64_t cx[6], cy[6], s = seed;
+		const uint8_t *block;
+		mritr_t itr;
+		rlditr_t di;
+		rld_t *e;
+		e = rld_init(6, 3);
+		rld_itr_init(e, &di, 0);
+		mr_itr_first(mr, &itr, 0);
+		while ((block = mr_itr_next_block(&itr)) != 0) {
+			const uint8_t *q = block + 2, *end = block + 2 + *rle_nptr(block);
+			while (q < end) {
+				int c = 0;
+				int64_t l;
+				rle_dec1(q, c, l);
+				rld_enc(e, &di, l, c);
+			}
+		}
+		rld_enc_finish(e, &di);
+		bm_start(t);
+		for (i = 0; i < n_ops; ++i) {
+			int64_t x = bm_rand(&s) % (tot + 1), y = x + (i & 63);
+			rld_rank2a(e, x, y < tot? y : tot, cx, cy);
+			sum += cx[i%6] + cy[i%6];
+		}
+		bm_stop(t, "rld_rank2a", n_ops, n_ops);
+		rld_destroy(e);
+	}
+	bm_sink = sum;
+	mr_destroy(mr);
+}
+
+/************
+ *** Main ***
+ ************/
+
+int main(int argc, char *argv[])
+{
+	int c, i, j, l, n_bl = 3, n_mn = 1, rlen = 100, n_threads = 1, n_data = 0, flag = 0;
+	int bl[BM_MAX_SET] = { 256, 512, 1024 }, mn[BM_MAX_SET] = { ROPE_DEF_MAX_NODES };
+	int64_t n_syms = 4000000, n_ops = 4000000;
+	uint64_t seed = 11;
+	bmdata_t *data;
+	bmtimer_t t;
+
+	while ((c = getopt(argc, argv, "l:n:k:N:r:L:s:t:")) >= 0) {
+		if (c == 'l') n_bl = parse_list(optarg, bl);
+		else if (c == 'n') n_mn = parse_list(optarg, mn);
+		else if (c == 'N') n_syms = parse_size(optarg);
+		else if (c == 'r') n_ops = parse_size(optarg);
+		else if (c == 'L') rlen = atoi(optarg);
+		else if (c == 's') seed = atol(optarg);
+		else if (c == 't') n_threads = atoi(optarg);
+		else if (c == 'k') {
+			char *p, *q;
+			for (p = optarg; *p; p = *q? q + 1 : q) {
+				for (q = p; *q && *q != ','; ++q);
+				for (j = 0; bm_kernels[j]; ++j)
+					if (strlen(bm_kernels[j]) == q - p && strncmp(bm_kernels[j], p, q - p) == 0) break;
+				if (bm_kernels[j] == 0) {
+					fprintf(stderr, "[E::%s] unknown kernel '%.*s'\n", __func__, (int)(q - p), p);
+					return 1;
+				}
+				flag |= 1<<j;
+			}
+		}
+	}
+	if (flag == 0) flag = BM_RLE_INS | BM_RLE_RANK | BM_ROPE_INS | BM_ROPE_RANK | BM_MR_INS1 | BM_MR_MULTI | BM_MR_RANK | BM_FRZ_RANK | BM_RLD_RANK;
+	if (n_bl == 0 || n_mn == 0 || n_syms <= 0 || n_ops <= 0 || rlen <= 0) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   ropebwt2-bench [options] [reads1.fq [reads2.fq [...]]]\n\n");
+		fprintf(stderr, "Options: -l LIST    leaf block lengths [256,512,1024]\n");
+		fprintf(stderr, "         -n LIST    max numbers of children per internal node [%d]\n", ROPE_DEF_MAX_NODES);
+		fprintf(stderr, "         -k LIST    kernels; all of %s", bm_kernels[0]);
+		for (j = 1; bm_kernels[j]; ++j) fprintf(stderr, ",%s", bm_kernels[j]);
+		fprintf(stderr, "\n");
+		fprintf(stderr, "         -N INT     symbols in each data set, including both strands [4m]\n");
+		fprintf(stderr, "         -r INT     rle_* calls and rank queries per setting [4m]\n");
+		fprintf(stderr, "         -L INT     length of synthetic reads [%d]\n", rlen);
+		fprintf(stderr, "         -s INT     random seed [%ld]\n", (long)seed);
+		fprintf(stderr, "         -t INT     number of threads for mr_insert_multi() [%d]\n", n_threads);
+		fprintf(stderr, "\nOne data set is synthetic 20X reads with 1%% errors; each file adds one more.\n");
+		fprintf(stderr, "Output is tab-delimited: kernel, data set, max_nodes (0 for leaf kernels), block_len,\n");
+		fprintf(stderr, "operations, ns/op, symbols/s, cache misses/op (NA without perf counters), peak RSS in kB.\n\n");
+		return 1;
+	}
+
+	data = (bmdata_t*)calloc(argc - optind + 1, sizeof(bmdata_t));
+	bm_synthetic(&data[n_data++], n_syms, rlen, seed);
+	for (i = optind; i < argc; ++i)
+		if (bm_read(&data[n_data], argv[i], n_syms) == 0 && data[n_data].n > 0) ++n_data;
+
+	memset(&t, 0, sizeof(bmtimer_t));
+	bm_perf_open(&t);
+	if (t.fd < 0) fprintf(stderr, "[W::%s] hardware cache-miss counter unavailable; reporting NA\n", __func__);
+	printf("#kernel\tdata\tmax_nodes\tblock_len\tn_ops\tns_per_op\tsym_per_s\tcache_miss_per_op\tpeak_rss_kb\n");
+	for (i = 0; i < n_data; ++i) {
+		t.data = data[i].name;
+		for (l = 0; l < n_bl; ++l) {
+			t.block_len = bl[l], t.max_nodes = 0;
+			if (flag & (BM_RLE_INS|BM_RLE_RANK)) bm_rle(&t, &data[i], flag, n_ops, seed);
+			for (j = 0; j < n_mn; ++j) {
+				t.max_nodes = mn[j];
+				if (flag & (BM_ROPE_INS|BM_ROPE_RANK)) bm_rope(&t, &data[i], flag, n_ops, seed);
+				if (flag & (BM_MR_INS1|BM_MR_MULTI)) bm_mrope(&t, &data[i], flag, n_threads);
+				if (flag & (BM_MR_RANK|BM_FRZ_RANK|BM_RLD_RANK)) bm_query(&t, &data[i], flag, n_ops, n_threads, seed);
+			}
+		}
+	}
+
+	if (t.fd >= 0) close(t.fd);
+	for (i = 0; i < n_data; ++i) free(data[i].name), free(data[i].s);
+	free(data);
+	return 0;
+}
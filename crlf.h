@@ -113,6 +113,23 @@ static inline int crlf_write(crlf_t *crlf, int c, uint64_t l)
 	return ret;
 }
 
+/**
+ * Write runs already encoded by the same codec
+ *
+ * The staging run is encoded first; it is not merged with the runs in $data.
+ *
+ * @param crlf    file handler
+ * @param data    encoded runs
+ * @param len     length of $data
+ */
+static inline void crlf_write_raw(crlf_t *crlf, const uint8_t *data, size_t len)
+{
+	if (crlf->l > 0) crlf->encode(crlf, crlf->c, crlf->l), crlf->l = 0;
+	fwrite(crlf->buf, 1, crlf->i, crlf->fp);
+	crlf->i = 0;
+	fwrite(data, 1, len, crlf->fp);
+}
+
 /**
  * Read one byte (bufferred)
  *
@@ -146,7 +163,7 @@ static inline int crlf_read_byte(crlf_t *crlf, uint32_t *l)
 static inline int crlf_read(crlf_t *crlf, uint64_t *l)
 {
 	int c, ret_c;
-	uint32_t l1;
+	uint32_t l1 = 0;
 	if (crlf->buf_len == 0) return -1;
 	while ((c = crlf_read_byte(crlf, &l1)) == crlf->c)
 		crlf->l += l1;
@@ -1,16 +1,19 @@
-#include <zlib.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include "rld0.h"
 #include "rle.h"
 #include "mrope.h"
 #include "crlf.h"
+#include "mtgz.h"
 #include "kseq.h"
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(mtgz_t*, mtgz_read)
 
 #define ROPEBWT2_VERSION "r187"
 
@@ -30,12 +33,17 @@ static unsigned char seq_nt6_table[128] = {
 #define FLAG_ODD 0x4
 #define FLAG_BIN 0x8
 #define FLAG_TREE 0x10
-#define FLAG_THR 0x40
+#define FLAG_MEMU 0x20
+#define FLAG_MMAP 0x40
 #define FLAG_LINE 0x100
 #define FLAG_RLD 0x200
 #define FLAG_NON 0x400
 #define FLAG_CRLF 0x800
 #define FLAG_CUTN 0x1000
+#define FLAG_PIPE 0x2000
+#define FLAG_FRZ 0x4000
+#define FLAG_PACK 0x8000
+#define FLAG_DUP 0x10000
 
 static inline int kputsn(const char *p, int l, kstring_t *s)
 {
@@ -52,6 +60,61 @@ static inline int kputsn(const char *p, int l, kstring_t *s)
 	return l;
 }
 
+static void batch_put(kstring_t *s, int64_t *len, int pk, const uint8_t *p, int l) // append $l symbols; $len counts the symbols in $s
+{
+	int64_t i, k = *len;
+	if (!pk) {
+		kputsn((char*)p, l, s);
+		*len += l;
+		return;
+	}
+	if ((size_t)((k + l + 1) >> 1) + 1 >= s->m) {
+		s->m = ((k + l + 1) >> 1) + 2;
+		kroundup32(s->m);
+		s->s = (char*)realloc(s->s, s->m);
+	}
+	for (i = 0; i < l; ++i, ++k) // two symbols per byte, the first in the low 4 bits
+		if (k&1) s->s[k>>1] |= p[i] << 4;
+		else s->s[k>>1] = p[i];
+	*len = k, s->l = (k + 1) >> 1;
+}
+
+static void batch_put_rc(kstring_t *s, int64_t *len, int pk, const uint8_t *p, int l) // append the reverse complement of $l symbols and a sentinel
+{
+	static const uint8_t comp6[6] = { 0, 4, 3, 2, 1, 5 };
+	int64_t i, k = *len;
+	if ((size_t)(pk? (k + l + 2) >> 1 : k + l + 1) + 1 >= s->m) {
+		s->m = (pk? (k + l + 2) >> 1 : k + l + 1) + 2;
+		kroundup32(s->m);
+		s->s = (char*)realloc(s->s, s->m);
+	}
+	if (!pk) {
+		uint8_t *q = (uint8_t*)s->s + k;
+		for (i = 0; i < l; ++i) q[i] = comp6[p[l-1-i]];
+		q[l] = 0, k += l + 1;
+		s->l = k, s->s[k] = 0;
+	} else {
+		for (i = 0; i <= l; ++i, ++k) {
+			int c = i < l? comp6[p[l-1-i]] : 0;
+			if (k&1) s->s[k>>1] |= c << 4;
+			else s->s[k>>1] = c;
+		}
+		s->l = (k + 1) >> 1;
+	}
+	*len = k;
+}
+
+static double parse_size(const char *s) // a number with an optional K/M/G suffix
+{
+	double x;
+	char *p;
+	x = strtod(s, &p);
+	if (*p == 'K' || *p == 'k') x *= 1024;
+	else if (*p == 'M' || *p == 'm') x *= 1024 * 1024;
+	else if (*p == 'G' || *p == 'g') x *= 1024 * 1024 * 1024;
+	return x;
+}
+
 static void liftrlimit() // increase the soft limit to hard limit
 {
 #ifdef __linux__
@@ -86,30 +149,713 @@ static inline int is_rev_same(int l, const uint8_t *s)
 	return (i == l>>1);
 }
 
+static mrope_t *restore_fmr(const char *fn) // read an index in either FMR format
+{
+	FILE *fp;
+	mrope_t *mr;
+	if ((mr = mr_restore_mmap(fn)) != 0) return mr;
+	if ((fp = fopen(fn, "rb")) == 0) {
+		fprintf(stderr, "[E::%s] fail to open file '%s'\n", __func__, fn);
+		return 0;
+	}
+	mr = mr_restore(fp);
+	fclose(fp);
+	if (mr == 0) fprintf(stderr, "[E::%s] file '%s' is not in the FMR format\n", __func__, fn);
+	return mr;
+}
+
+/****************************
+ *** Loading BWTs with -i ***
+ ****************************/
+
+#define LOAD_BUF 0x10000
+
+static int load_txt(const char *fn, mrbuild_t *b, int64_t c[6]) // read a BWT in plain text; count symbols into $c, or pass runs to $b
+{
+	FILE *fp;
+	uint8_t *buf;
+	int64_t l = 0;
+	int i, n, cc = -1, ret = 0;
+	if ((fp = fopen(fn, "rb")) == 0) return -1;
+	buf = malloc(LOAD_BUF);
+	while (ret == 0 && (n = fread(buf, 1, LOAD_BUF, fp)) > 0) {
+		for (i = 0; i < n; ++i) {
+			int x = buf[i];
+			if (isspace(x)) continue;
+			if (x == '$') x = 0;
+			else if (isalpha(x)) x = seq_nt6_table[x];
+			else {
+				ret = -1;
+				break;
+			}
+			if (x != cc) {
+				if (b && l) mr_build_run(b, cc, l);
+				cc = x, l = 0;
+			}
+			++l;
+			if (!b) ++c[x];
+		}
+	}
+	if (b && l) mr_build_run(b, cc, l);
+	free(buf);
+	fclose(fp);
+	return ret;
+}
+
+static int load_crlf(const char *fn, mrbuild_t *b, int64_t c[6]) // the same as load_txt() for a CRLF file
+{
+	crlf_t *crlf;
+	uint64_t l;
+	uint32_t i;
+	int x, ret = 0;
+	if ((crlf = crlf_open(fn)) == 0) return -1;
+	if (!b) { // take the counts written by ropebwt2 if present
+		for (i = 0; i < crlf->n_tags; ++i)
+			if (crlf->tags[i].tag[0] == 'M' && crlf->tags[i].tag[1] == 'C' && crlf->tags[i].len == 48) {
+				memcpy(c, crlf->tags[i].data, 48);
+				crlf_close(crlf);
+				return 0;
+			}
+	}
+	while ((x = crlf_read(crlf, &l)) >= 0) {
+		if (x >= 6) {
+			ret = -1;
+			break;
+		}
+		if (b) mr_build_run(b, x, l);
+		else c[x] += l;
+	}
+	crlf_close(crlf);
+	return ret;
+}
+
+static mrope_t *load_index(const char *fn, int so, int max_nodes, int block_len, int mem_mode, double fill)
+{ // read an index in FMR, or build one from a BWT in FMD, CRLF or plain text; only FMR records the sorting order
+	FILE *fp;
+	char magic[4];
+	mrope_t *mr;
+	mrbuild_t *b;
+	int64_t c[6];
+	int ret = 0;
+	if ((fp = fopen(fn, "rb")) == 0) {
+		fprintf(stderr, "[E::%s] fail to open file '%s'\n", __func__, fn);
+		return 0;
+	}
+	if (fread(magic, 1, 4, fp) != 4) { // empty or too short for any format
+		fclose(fp);
+		fprintf(stderr, "[E::%s] file '%s' is not a valid index in FMR, FMD or CRLF or a BWT in plain text\n", __func__, fn);
+		return 0;
+	}
+	fclose(fp);
+	if (magic[0] == 'R' && magic[1] == 'B' && magic[2] <= 3) return restore_fmr(fn);
+	mr = mr_init(max_nodes, block_len, so);
+	if (mem_mode) mr_mem_mode(mr, mem_mode);
+	memset(c, 0, 48);
+	if (strncmp(magic, "RLD\3", 4) == 0) {
+		rld_t *e;
+		rlditr_t itr;
+		int64_t l;
+		int x;
+		if ((e = rld_restore(fn)) == 0 || e->asize != 6) ret = -1;
+		else {
+			for (x = 0; x < 6; ++x) c[x] = e->mcnt[x+1];
+			b = mr_build_init(mr, c, fill);
+			rld_itr_init(e, &itr, 0);
+			while ((l = rld_dec(e, &itr, &x, 0)) > 0)
+				mr_build_run(b, x, l);
+			ret = mr_build_finish(b);
+		}
+		if (e) rld_destroy(e);
+	} else {
+		int (*load)(const char*, mrbuild_t*, int64_t*) = strncmp(magic, "CRL\1", 4) == 0? load_crlf : load_txt;
+		if ((ret = load(fn, 0, c)) == 0) { // count symbols first, then read the file again
+			b = mr_build_init(mr, c, fill);
+			ret = load(fn, b, c);
+			if (mr_build_finish(b) < 0) ret = -1;
+		}
+	}
+	if (ret < 0) {
+		fprintf(stderr, "[E::%s] file '%s' is not a valid index in FMR, FMD or CRLF or a BWT in plain text\n", __func__, fn);
+		mr_destroy(mr);
+		return 0;
+	}
+	return mr;
+}
+
+#define MRG_MAX_DEPTH 64
+
+typedef struct {
+	int n, lv[MRG_MAX_DEPTH]; // $lv: the number of pairwise merges that made the index, roughly log2(#shards)
+	mrope_t *mr[MRG_MAX_DEPTH];
+	const char *fn[MRG_MAX_DEPTH]; // the first file in each index
+} mrgstk_t;
+
+static int merge_top(mrgstk_t *s, double fill, int n_threads, int verbose) // merge the top index into the one below
+{
+	mrope_t *a = s->mr[s->n-2], *b = s->mr[s->n-1];
+	double t = realtime();
+	if (mr_get_tot(a) == 0) a->so = b->so; // an empty index takes any order
+	if (mr_merge(a, b, fill, n_threads) < 0) {
+		fprintf(stderr, "[E::%s] '%s' is in a different sorting order from the preceding indices\n", __func__, s->fn[s->n-1]);
+		return -1;
+	}
+	if (verbose >= 3) fprintf(stderr, "[M::%s] merged %ld symbols starting from '%s' in %.3f sec\n",
+			__func__, (long)mr_get_tot(b), s->fn[s->n-1], realtime() - t);
+	mr_destroy(b);
+	--s->n, ++s->lv[s->n-1];
+	return 0;
+}
+
+static mrope_t *merge_fmr(mrope_t *mr, int n, char **fn, double fill, int n_threads, int mem_mode, int verbose)
+{ // merge the indices in $fn into $mr in order; return NULL and free $mr on errors
+	mrgstk_t s;
+	int i, ret = 0;
+	s.n = 1, s.mr[0] = mr, s.lv[0] = 0, s.fn[0] = "-";
+	for (i = 0; i < n && ret == 0; ++i) { // pair indices of similar sizes like a binary counter, loading one file at a time
+		mrope_t *b;
+		if ((b = restore_fmr(fn[i])) == 0) {
+			ret = -1;
+			break;
+		}
+		if (mem_mode) mr_mem_mode(b, mem_mode);
+		if (s.n == 1 && mr_get_tot(s.mr[0]) == 0) { // nothing to merge into; the first index takes the place
+			mr_destroy(s.mr[0]);
+			s.mr[0] = b, s.fn[0] = fn[i];
+			continue;
+		}
+		s.mr[s.n] = b, s.lv[s.n] = 0, s.fn[s.n++] = fn[i];
+		while (ret == 0 && s.n >= 2 && s.lv[s.n-1] == s.lv[s.n-2])
+			ret = merge_top(&s, fill, n_threads, verbose);
+	}
+	while (ret == 0 && s.n >= 2)
+		ret = merge_top(&s, fill, n_threads, verbose);
+	if (ret < 0) {
+		for (i = 0; i < s.n; ++i) mr_destroy(s.mr[i]);
+		return 0;
+	}
+	return s.mr[0];
+}
+
+/*******************
+ *** Checkpoints ***
+ *******************/
+
+#define CKPT_MAGIC "RB2CKPT"
+
+typedef struct {
+	const char *fn, *fn_in; // checkpoint file, or NULL to disable; the input file
+	int every; // write a checkpoint after every $every batches
+	pid_t pid; // the process writing the last checkpoint; 0 for none
+} ckpt_t;
+
+static int ckpt_write(mrope_t *mr, const char *fn, const char *fn_in, int64_t n_seqs)
+{ // a header line with the sequences already in the index, followed by the index in FMR; written to FILE.tmp and renamed
+	char *tmp;
+	FILE *fp;
+	int ret = -1;
+	tmp = malloc(strlen(fn) + 5);
+	sprintf(tmp, "%s.tmp", fn);
+	if ((fp = fopen(tmp, "wb")) != 0) {
+		fprintf(fp, "%s\t%ld\t%s\n", CKPT_MAGIC, (long)n_seqs, fn_in);
+		mr_dump(mr, fp);
+		if (fflush(fp) == 0 && fsync(fileno(fp)) == 0) ret = 0;
+		if (fclose(fp) != 0) ret = -1;
+		if (ret == 0 && rename(tmp, fn) != 0) ret = -1;
+		if (ret < 0) unlink(tmp);
+	}
+	free(tmp);
+	return ret;
+}
+
+static int ckpt_reap(ckpt_t *c, int block) // return 0 if no checkpoint is being written
+{
+	int status;
+	if (c->pid == 0) return 0;
+	if (waitpid(c->pid, &status, block? 0 : WNOHANG) == 0) return 1;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fprintf(stderr, "[W::%s] failed to write checkpoint '%s'\n", __func__, c->fn);
+	c->pid = 0;
+	return 0;
+}
+
+static void ckpt_start(ckpt_t *c, mrope_t *mr, int64_t n_seqs, int verbose)
+{ // the forked child dumps a copy-on-write snapshot of the index while the parent goes on inserting
+	pid_t pid;
+	if (ckpt_reap(c, 0)) {
+		if (verbose >= 2) fprintf(stderr, "[W::%s] skipped a checkpoint as the last one is still being written\n", __func__);
+		return;
+	}
+	if ((pid = fork()) < 0) {
+		fprintf(stderr, "[W::%s] failed to fork; checkpoint skipped\n", __func__);
+		return;
+	}
+	if (pid == 0) _exit(ckpt_write(mr, c->fn, c->fn_in, n_seqs) == 0? 0 : 1); // no atexit handlers or buffered output from the parent
+	c->pid = pid;
+	if (verbose >= 3) fprintf(stderr, "[M::%s] writing a checkpoint of the first %ld sequences to '%s'\n", __func__, (long)n_seqs, c->fn);
+}
+
+static void ckpt_done(ckpt_t *c) // the final output is written; drop the checkpoint
+{
+	char *tmp;
+	if (c->pid) kill(c->pid, SIGKILL), ckpt_reap(c, 1);
+	tmp = malloc(strlen(c->fn) + 5);
+	sprintf(tmp, "%s.tmp", c->fn);
+	unlink(tmp); unlink(c->fn);
+	free(tmp);
+}
+
+static int ckpt_resume(const char *fn, const char *fn_in, mrope_t **mr, int64_t *n_seqs)
+{ // return 0 if there is no checkpoint, 1 if $mr and $n_seqs are read from it, or -1 on errors
+	FILE *fp;
+	char *line = 0, *p, *q;
+	size_t cap = 0;
+	ssize_t l;
+	int ret = -1;
+	if ((fp = fopen(fn, "rb")) == 0) return 0;
+	*mr = 0;
+	if ((l = getline(&line, &cap, fp)) > 0 && strncmp(line, CKPT_MAGIC "\t", 8) == 0) {
+		*n_seqs = strtol(line + 8, &p, 10);
+		if (line[l-1] == '\n') line[--l] = 0;
+		q = *p == '\t'? p + 1 : p;
+		if (*p != '\t' || *n_seqs < 0) fprintf(stderr, "[E::%s] malformed checkpoint '%s'\n", __func__, fn);
+		else if (strcmp(q, fn_in) != 0) fprintf(stderr, "[E::%s] checkpoint '%s' was taken from input '%s', not '%s'\n", __func__, fn, q, fn_in);
+		else if ((*mr = mr_restore(fp)) == 0) fprintf(stderr, "[E::%s] failed to read the index in checkpoint '%s'\n", __func__, fn);
+		else ret = 1;
+	} else fprintf(stderr, "[E::%s] '%s' is not a checkpoint\n", __func__, fn);
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+/**************************************
+ *** Folding identical strings (-u) ***
+ **************************************/
+
+#define DUP_IDX_BITS 40 // low bits of a slot: 1 + the index of a distinct string; high bits: the top of its hash
+
+typedef struct { // distinct strings in the batch being filled
+	int64_t n, m; // number of distinct strings, and the size of $off and $cnt
+	int64_t n_cp; // number of strings, copies included
+	int64_t *off; // where each distinct string starts in the batch; they are stored in order, without gaps
+	uint32_t *cnt; // copies of each distinct string
+	int bits; // $h has 1<<bits slots
+	uint64_t *h; // open addressing with linear probing
+} dedup_t;
+
+#define batch_sym(s, k, pk) ((pk)? (uint8_t)(s)[(k)>>1] >> (((k)&1)<<2) & 0xf : (uint8_t)(s)[k])
+
+static uint64_t dup_hash(const char *s, int64_t beg, int64_t end, int pk) // FNV-1a of symbols [beg,end), then mixed
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int64_t k;
+	for (k = beg; k < end; ++k)
+		h = (h ^ batch_sym(s, k, pk)) * 0x100000001b3ULL;
+	h ^= h >> 33, h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33, h *= 0xc4ceb9fe1a85ec53ULL;
+	return h ^ h >> 33;
+}
+
+static int dup_eq(const char *s, int pk, int64_t x, int64_t y, int64_t l) // whether symbols [x,x+l) and [y,y+l) are the same
+{
+	int64_t k;
+	if (!pk) return memcmp(s + x, s + y, l) == 0;
+	for (k = 0; k < l; ++k)
+		if (batch_sym(s, x + k, 1) != batch_sym(s, y + k, 1)) return 0;
+	return 1;
+}
+
+static void dup_insert(dedup_t *d, uint64_t h, int64_t i) // add distinct string $i to the table
+{
+	uint64_t mask = (1ULL<<d->bits) - 1, k;
+	for (k = h & mask; d->h[k]; k = (k + 1) & mask);
+	d->h[k] = (h >> DUP_IDX_BITS << DUP_IDX_BITS) | (uint64_t)(i + 1);
+}
+
+static void dup_grow(dedup_t *d, const char *s, int pk, int64_t end) // double the table; distinct strings end at $end
+{
+	int64_t i;
+	if (d->n == d->m) {
+		d->m = d->m? d->m<<1 : 0x10000;
+		d->off = realloc(d->off, d->m * sizeof(int64_t));
+		d->cnt = realloc(d->cnt, d->m * sizeof(uint32_t));
+	}
+	if (d->h && (d->n + 1) * 4 < 3LL<<d->bits) return;
+	d->bits = d->bits? d->bits + 1 : 16;
+	free(d->h);
+	d->h = calloc(1ULL<<d->bits, 8);
+	for (i = 0; i < d->n; ++i) // the hashes are not kept; compute them again
+		dup_insert(d, dup_hash(s, d->off[i], (i + 1 < d->n? d->off[i+1] : end) - 1, pk), i);
+}
+
+static int64_t dup_put(dedup_t *d, kstring_t *s, int64_t *len, int pk, int64_t beg)
+{ // fold strings appended at [beg,*len) into earlier copies, and move the new ones down; return the number of new distinct strings
+	int64_t a, b, w = beg, n0 = d->n;
+	for (a = beg; a < *len; a = b + 1) {
+		uint64_t h, mask = (1ULL<<d->bits) - 1, k;
+		int64_t l, i = -1;
+		for (b = a; batch_sym(s->s, b, pk) != 0; ++b); // $b is at the sentinel
+		l = b + 1 - a, ++d->n_cp;
+		h = dup_hash(s->s, a, b, pk);
+		if (d->h) {
+			for (k = h & mask; d->h[k]; k = (k + 1) & mask) {
+				int64_t j = (d->h[k] & ((1ULL<<DUP_IDX_BITS) - 1)) - 1;
+				if (d->h[k] >> DUP_IDX_BITS != h >> DUP_IDX_BITS) continue;
+				if ((j + 1 < d->n? d->off[j+1] : w) - d->off[j] == l && dup_eq(s->s, pk, d->off[j], a, l)) {
+					i = j;
+					break;
+				}
+			}
+		}
+		if (i >= 0 && d->cnt[i] < UINT32_MAX) {
+			++d->cnt[i];
+			continue;
+		}
+		if (w != a) { // an earlier string was folded; close the gap
+			if (!pk) memmove(s->s + w, s->s + a, l);
+			else for (k = 0; k < l; ++k) {
+				int64_t x = w + k, c = batch_sym(s->s, a + k, 1);
+				if (x&1) s->s[x>>1] = (s->s[x>>1] & 0xf) | c << 4;
+				else s->s[x>>1] = (s->s[x>>1] & 0xf0) | c;
+			}
+		}
+		dup_grow(d, s->s, pk, w);
+		d->off[d->n] = w, d->cnt[d->n] = 1;
+		dup_insert(d, h, d->n++);
+		w += l;
+	}
+	if (w < *len) { // drop the tail
+		*len = w, s->l = pk? (w + 1) >> 1 : w;
+		if (pk && (w&1)) s->s[w>>1] &= 0xf;
+		if (!pk) s->s[w] = 0;
+	}
+	return d->n - n0;
+}
+
+static void dup_reset(dedup_t *d)
+{
+	d->n = d->n_cp = 0;
+	if (d->h) memset(d->h, 0, 8ULL<<d->bits);
+}
+
+static void dup_destroy(dedup_t *d)
+{
+	free(d->off); free(d->cnt); free(d->h);
+}
+
+/***************************
+ *** Batch double-buffer ***
+ ***************************/
+
+#define BATCH_DEF_BPS  1.        // bytes per symbol assumed for an empty index
+#define BATCH_MIN_SIZE 0x1000000 // batches are at least this long, even if the index alone exceeds the budget
+
+typedef struct {
+	mrope_t *mr;
+	int n_threads, running; // $running: 0 for idle, 1 for finished but not reported, 2 for running in $tid
+	pthread_t tid;
+	kstring_t buf; // the batch being inserted
+	int64_t len; // symbols in $buf
+	int pk; // $buf is packed in 4 bits per symbol
+	dedup_t dd; // with -u, the copies of each string in $buf
+	double rt, ct;
+	double compact; // repack the index to this fill factor after each batch; 0 to disable
+	int64_t freed; // bytes freed by the compaction
+	int64_t budget; // memory budget in bytes; 0 for batches of a fixed size
+	int64_t mem; // estimated memory of the index once the running batch is inserted
+	double bps; // bytes of the index per symbol, measured after the last batch
+	int64_t n_batches;
+	FILE *fp_stat; // statistics after each batch as JSON lines; NULL to disable
+	int64_t n_seqs; // input sequences up to the end of the running batch
+	int at_eof; // the input is exhausted; no more checkpoints
+	ckpt_t ck;
+} batch_t;
+
+static void *batch_worker(void *data)
+{
+	batch_t *b = (batch_t*)data;
+	if (b->dd.n) mr_insert_multi_cnt(b->mr, b->len, (uint8_t*)b->buf.s, b->pk, b->dd.cnt, b->n_threads);
+	else if (b->pk) mr_insert_multi4(b->mr, b->len, (uint8_t*)b->buf.s, b->n_threads);
+	else mr_insert_multi(b->mr, b->len, (uint8_t*)b->buf.s, b->n_threads);
+	if (b->compact > 0.) b->freed = mr_compact(b->mr, b->compact);
+	return 0;
+}
+
+static int64_t index_mem(const mrope_t *mr) // bytes taken by the ropes
+{
+	int64_t mem = mr->mm_size;
+	int a;
+	for (a = 0; a < 6; ++a) {
+		rpmemstat_t sn, sl;
+		rope_mem_stat(mr->r[a], &sn, &sl);
+		mem += sn.reserved + sl.reserved;
+	}
+	return mem;
+}
+
+typedef struct {
+	int64_t n_leaves, n_splits[2]; // leaf and internal node splits
+	double fill; // fraction of the leaf space taken by runs
+	int64_t used, reserved; // bytes handed out by and reserved in the memory pools
+} idxstat_t;
+
+static void index_stat(const mrope_t *mr, idxstat_t *s)
+{
+	int a;
+	memset(s, 0, sizeof(idxstat_t));
+	for (a = 0; a < 6; ++a) {
+		const rope_t *r = mr->r[a];
+		rpmemstat_t sn, sl;
+		int64_t n;
+		s->fill += rope_fill(r, &n) * n, s->n_leaves += n;
+		s->n_splits[0] += r->n_splits[0], s->n_splits[1] += r->n_splits[1];
+		rope_mem_stat(r, &sn, &sl);
+		s->used += sn.used + sl.used, s->reserved += sn.reserved + sl.reserved;
+	}
+	if (s->n_leaves) s->fill /= s->n_leaves;
+}
+
+static void batch_stat(const batch_t *b, int verbose) // statistics accumulated since the start
+{
+	const mrstat_t *st = &b->mr->st;
+	idxstat_t is;
+	int i;
+	index_stat(b->mr, &is);
+	if (verbose >= 4) {
+		fprintf(stderr, "[M::%s] after %ld batches: %.3f sec partitioning, %.3f sec inserting and %.3f sec updating intervals in %ld rounds\n",
+				__func__, (long)b->n_batches, st->t_sort, st->t_ins, st->t_upd, (long)st->n_rounds);
+		fprintf(stderr, "[M::%s] after %ld batches: inserting into buckets ($, A, C, G, T, N) took (%.3f, %.3f, %.3f, %.3f, %.3f, %.3f) sec\n",
+				__func__, (long)b->n_batches, st->t_bucket[0], st->t_bucket[1], st->t_bucket[2], st->t_bucket[3], st->t_bucket[4], st->t_bucket[5]);
+		if (st->n_threads) {
+			fprintf(stderr, "[M::%s] after %ld batches: threads were busy for (", __func__, (long)b->n_batches);
+			for (i = 0; i < st->n_threads; ++i) fprintf(stderr, "%s%.3f", i? ", " : "", st->t_busy[i]);
+			fprintf(stderr, ") of %.3f sec on the thread pool\n", st->t_par);
+		}
+		fprintf(stderr, "[M::%s] after %ld batches: %ld leaves %.1f%% full; %ld leaf and %ld node splits; pools at %.1f/%.1f MB\n",
+				__func__, (long)b->n_batches, (long)is.n_leaves, is.fill * 100., (long)is.n_splits[0], (long)is.n_splits[1],
+				is.used / 1048576., is.reserved / 1048576.);
+	}
+	if (b->fp_stat) {
+		FILE *fp = b->fp_stat;
+		fprintf(fp, "{\"batch\":%ld,\"symbols\":%ld,\"rounds\":%ld,\"par_rounds\":%ld", (long)b->n_batches, (long)mr_get_tot(b->mr),
+				(long)st->n_rounds, (long)st->n_par_rounds);
+		fprintf(fp, ",\"t_sort\":%.6f,\"t_ins\":%.6f,\"t_upd\":%.6f,\"t_par\":%.6f,\"t_max_round\":%.6f,\"t_idle\":%.6f,\"sleeps\":%ld",
+				st->t_sort, st->t_ins, st->t_upd, st->t_par, st->t_max_round, st->t_idle, (long)st->n_sleeps);
+		fprintf(fp, ",\"t_bucket\":[");
+		for (i = 0; i < 6; ++i) fprintf(fp, "%s%.6f", i? "," : "", st->t_bucket[i]);
+		fprintf(fp, "],\"t_busy\":[");
+		for (i = 0; i < st->n_threads; ++i) fprintf(fp, "%s%.6f", i? "," : "", st->t_busy[i]);
+		fprintf(fp, "],\"leaves\":%ld,\"leaf_fill\":%.4f,\"leaf_splits\":%ld,\"node_splits\":%ld,\"mem_used\":%ld,\"mem_reserved\":%ld}\n",
+				(long)is.n_leaves, is.fill, (long)is.n_splits[0], (long)is.n_splits[1], (long)is.used, (long)is.reserved);
+		fflush(fp);
+	}
+}
+
+static void batch_measure(batch_t *b) // measure the index for the memory budget
+{
+	int64_t tot = mr_get_tot(b->mr);
+	b->mem = index_mem(b->mr);
+	b->bps = tot? (double)b->mem / tot : BATCH_DEF_BPS;
+}
+
+static int batch_full(const batch_t *b, const kstring_t *buf, int64_t len, int64_t n_strs, const dedup_t *dd) // whether $buf, of $len symbols, is the largest batch within the budget
+{
+	int64_t need;
+	if (len < BATCH_MIN_SIZE) return 0;
+	need = b->mem + buf->m + n_strs * MR_STR_BYTES + (int64_t)(len * b->bps); // the buffer, the working space and the growth of the index
+	if (dd) need += dd->m * 12 + (dd->h? 8LL<<dd->bits : 0); // the table of distinct strings
+	need += b->buf.m > buf->m? b->buf.m : buf->m; // the other buffer, into which the next batch is read with -p
+	return need >= b->budget;
+}
+
+static void batch_wait(batch_t *b, int verbose) // wait for the running batch to finish
+{
+	if (!b->running) return;
+	if (b->running > 1) pthread_join(b->tid, 0);
+	b->running = 0;
+	++b->n_batches;
+	if (b->budget) batch_measure(b);
+	if (verbose >= 3) fprintf(stderr, "[M::%s] inserted %ld symbols in %.3f sec, %.3f CPU sec\n",
+			__func__, (long)b->len, realtime() - b->rt, cputime() - b->ct);
+	if (verbose >= 3 && b->compact > 0.)
+		fprintf(stderr, "[M::%s] compaction changed the index memory by %+.1f MB\n", __func__, -b->freed / 1048576.);
+	if (verbose >= 4 || b->fp_stat) batch_stat(b, verbose);
+	if (b->ck.fn && !b->at_eof && b->n_batches % b->ck.every == 0)
+		ckpt_start(&b->ck, b->mr, b->n_seqs, verbose);
+}
+
+static void batch_insert(batch_t *b, kstring_t *buf, int64_t *len, dedup_t *dd, int64_t n_seqs, int is_pipe, int verbose)
+{ // insert $buf of $len symbols, which ends at the $n_seqs-th input sequence; with $is_pipe, return immediately and let the caller fill the swapped-in buffer in the meantime
+	kstring_t tmp;
+	batch_wait(b, verbose);
+	b->n_seqs = n_seqs;
+	tmp = b->buf; b->buf = *buf; *buf = tmp;
+	b->len = *len;
+	buf->l = 0, *len = 0;
+	if (dd) { // the counts go with the batch
+		dedup_t t = b->dd; b->dd = *dd; *dd = t;
+		dup_reset(dd);
+		if (verbose >= 3) fprintf(stderr, "[M::%s] folded %ld strings into %ld distinct ones\n", __func__, (long)b->dd.n_cp, (long)b->dd.n);
+	}
+	if (b->budget) {
+		if (verbose >= 3) fprintf(stderr, "[M::%s] inserting a batch of %ld symbols into an index of %.1f MB\n",
+				__func__, (long)b->len, b->mem / 1048576.);
+		b->mem += (int64_t)(b->len * b->bps);
+	}
+	b->rt = realtime(); b->ct = cputime();
+	if (is_pipe) {
+		pthread_create(&b->tid, 0, batch_worker, b);
+		b->running = 2;
+	} else {
+		batch_worker(b);
+		b->running = 1;
+		batch_wait(b, verbose);
+	}
+}
+
+/********************
+ *** Index export ***
+ ********************/
+
+#define EXP_SEG_BYTES 0x1000000 // max leaf bytes in a segment; each thread encodes one segment at a time
+#define EXP_TXT_BUF   0x10000   // output buffer for plain text
+
+typedef struct {
+	int flag;
+	const uint8_t **leaf;
+	int64_t beg, end; // leaves in this segment
+	rld_t *e; // FMD: the encoded segment
+	rlditr_t itr;
+	int c[2]; // CRLF: the first and the last run, which may be merged with those in the neighbouring segments
+	int64_t l[2];
+	char *data; // CRLF: encoded runs between the first and the last run
+	size_t len;
+} expseg_t;
+
+static void *exp_worker(void *data)
+{
+	expseg_t *g = (expseg_t*)data;
+	crlf_t *crlf = 0;
+	int64_t i, cl = 0;
+	int cc = -1;
+	if (g->flag & FLAG_RLD) {
+		g->e = rld_init(6, 3);
+		rld_itr_init(g->e, &g->itr, 0);
+	} else {
+		crlf = calloc(1, sizeof(crlf_t));
+		crlf->n_symbols = 6, crlf->encode = crlf_write_RL53, crlf->is_writing = 1;
+		crlf->fp = open_memstream(&g->data, &g->len);
+	}
+	g->l[0] = g->l[1] = 0;
+	for (i = g->beg; i < g->end; ++i) {
+		const uint8_t *q = g->leaf[i] + 2, *end = q + *rle_nptr(g->leaf[i]);
+		while (q < end) {
+			int c = 0;
+			int64_t l;
+			rle_dec1(q, c, l);
+			if (crlf == 0) rld_enc(g->e, &g->itr, l, c);
+			else if (c == cc) cl += l;
+			else { // keep the first run aside; crlf_write() keeps the last one pending
+				if (cl && g->l[0] == 0) g->c[0] = cc, g->l[0] = cl;
+				else if (cl) crlf_write(crlf, cc, cl);
+				cc = c, cl = l;
+			}
+		}
+	}
+	if (crlf) {
+		if (g->l[0] == 0) g->c[0] = cc, g->l[0] = cl;
+		else crlf_write(crlf, cc, cl);
+		g->c[1] = crlf->c, g->l[1] = crlf->l;
+		fwrite(crlf->buf, 1, crlf->i, crlf->fp);
+		fclose(crlf->fp);
+		free(crlf);
+	}
+	return 0;
+}
+
+static void exp_segs(mrope_t *mr, int flag, int n_threads, rld_t *e, rlditr_t *di, crlf_t *crlf)
+{ // encode segments of leaves on $n_threads threads and write them out in order
+	mritr_t itr;
+	const uint8_t *block, **leaf = 0;
+	int64_t i, j, n = 0, m = 0, n_seg = 0, tot = 0, acc, max_bytes;
+	expseg_t *seg;
+	pthread_t *tid;
+
+	mr_itr_first(mr, &itr, 0);
+	while ((block = mr_itr_next_block(&itr)) != 0) {
+		if (n == m) m = m? m<<1 : 1024, leaf = realloc(leaf, m * sizeof(void*));
+		leaf[n++] = block, tot += *rle_nptr(block);
+	}
+	max_bytes = tot / n_threads + 1 < EXP_SEG_BYTES? tot / n_threads + 1 : EXP_SEG_BYTES;
+	seg = calloc(tot / max_bytes + n_threads + 1, sizeof(expseg_t));
+	for (i = j = acc = 0; i < n; ++i) { // cut the leaves into segments of at most $max_bytes bytes
+		acc += *rle_nptr(leaf[i]);
+		if (acc >= max_bytes || i == n - 1) {
+			seg[n_seg].flag = flag, seg[n_seg].leaf = leaf;
+			seg[n_seg].beg = j, seg[n_seg++].end = i + 1;
+			j = i + 1, acc = 0;
+		}
+	}
+	tid = calloc(n_threads, sizeof(pthread_t));
+	for (i = 0; i < n_seg; i += n_threads) {
+		int64_t k, n_run = n_seg - i < n_threads? n_seg - i : n_threads;
+		for (k = 1; k < n_run; ++k) pthread_create(&tid[k], 0, exp_worker, &seg[i+k]);
+		exp_worker(&seg[i]);
+		for (k = 1; k < n_run; ++k) pthread_join(tid[k], 0);
+		for (k = 0; k < n_run; ++k) {
+			expseg_t *g = &seg[i+k];
+			if (flag & FLAG_RLD) {
+				rld_cat(e, di, g->e, &g->itr);
+				rld_destroy(g->e);
+			} else {
+				if (g->l[0]) crlf_write(crlf, g->c[0], g->l[0]);
+				if (g->len) crlf_write_raw(crlf, (uint8_t*)g->data, g->len);
+				if (g->l[1]) crlf_write(crlf, g->c[1], g->l[1]);
+				free(g->data);
+			}
+		}
+	}
+	free(tid); free(seg); free(leaf);
+}
+
 int main_ropebwt2(int argc, char *argv[])
 {
 	mrope_t *mr = 0;
-	gzFile fp;
-	kseq_t *ks;
+	mtgz_t *fp = 0;
+	kseq_t *ks = 0;
 	int64_t m = (int64_t)(.97 * 10 * 1024 * 1024 * 1024) + 1;;
-	int c, i, block_len = ROPE_DEF_BLOCK_LEN, max_nodes = ROPE_DEF_MAX_NODES, from_stdin = 0, verbose = 3, so = MR_SO_IO, min_q = 0, thr_min = -1, min_cut_len = 0;
-	int flag = FLAG_FOR | FLAG_REV | FLAG_THR;
+	int c, i, ckpt_every = 1, block_len = ROPE_DEF_BLOCK_LEN, max_nodes = ROPE_DEF_MAX_NODES, from_stdin = 0, verbose = 3, so = MR_SO_IO, min_q = 0, thr_min = -1, bcr_max_len = -1, min_cut_len = 0, n_threads = 5, mem_mode = 0, n_mrg = 0, shard = 0, n_shards = 1;
+	int64_t n_seqs = 0, n_strs = 0, budget = 0, n_skip = 0, buf_len = 0;
+	char **fn_mrg = 0;
+	FILE *fp_stat = 0;
+	const char *fn_ckpt = 0, *fn_idx = 0;
+	double compact = 0.;
+	int flag = FLAG_FOR | FLAG_REV;
 	kstring_t buf = { 0, 0, 0 };
+	dedup_t dd;
+	batch_t bt;
 	double ct, rt;
 
-	while ((c = getopt(argc, argv, "BPNLTFRCtrbdsl:n:m:v:o:i:q:M:x:")) >= 0) {
+	while ((c = getopt(argc, argv, "BPNLTFRCHGUDZzurpbdsl:n:m:v:o:i:q:M:x:t:c:a:S:E:j:O:k:e:")) >= 0) {
 		if (c == 'o') freopen(optarg, "w", stdout);
 		else if (c == 'F') flag &= ~FLAG_FOR;
 		else if (c == 'R') flag &= ~FLAG_REV;
 		else if (c == 'C') flag |= FLAG_ODD;
 		else if (c == 'T') flag |= FLAG_TREE;
 		else if (c == 'b') flag |= FLAG_BIN;
-		else if (c == 't') flag |= FLAG_THR;
+		else if (c == 'D') flag |= FLAG_MMAP;
+		else if (c == 'Z') flag |= FLAG_FRZ;
+		else if (c == 'z') flag |= FLAG_PACK;
+		else if (c == 'u') flag |= FLAG_DUP;
 		else if (c == 'L') flag |= FLAG_LINE;
 		else if (c == 'd') flag |= FLAG_RLD;
 		else if (c == 'N') flag |= FLAG_NON;
 		else if (c == 'B') flag |= FLAG_CRLF;
-		else if (c == 'P') flag &= ~FLAG_THR;
+		else if (c == 'P') n_threads = 1;
+		else if (c == 'H') mem_mode |= ROPE_MEM_HUGE;
+		else if (c == 'G') mem_mode |= ROPE_MEM_HUGE | ROPE_MEM_HUGE1G;
+		else if (c == 'U') flag |= FLAG_MEMU;
+		else if (c == 'c') compact = atof(optarg);
+		else if (c == 'p') flag |= FLAG_PIPE;
 		else if (c == 's') so = so != MR_SO_RCLO? MR_SO_RLO : MR_SO_RCLO;
 		else if (c == 'r') so = MR_SO_RCLO;
 		else if (c == 'l') block_len = atoi(optarg);
@@ -117,48 +863,75 @@ int main_ropebwt2(int argc, char *argv[])
 		else if (c == 'v') verbose = atoi(optarg);
 		else if (c == 'q') min_q = atoi(optarg);
 		else if (c == 'M') thr_min = atoi(optarg);
+		else if (c == 'e') bcr_max_len = atoi(optarg);
+		else if (c == 't') n_threads = atoi(optarg) > 0? atoi(optarg) : 1;
 		else if (c == 'x') min_cut_len = atoi(optarg), flag |= FLAG_CUTN;
-		else if (c == 'i') {
-			FILE *fp;
-			if ((fp = fopen(optarg, "rb")) == 0) {
-				fprintf(stderr, "[E::%s] fail to open file '%s'\n", __func__, optarg);
+		else if (c == 'i') fn_idx = optarg;
+		else if (c == 'S') {
+			char *p;
+			shard = strtol(optarg, &p, 10);
+			n_shards = *p == '/'? strtol(p + 1, &p, 10) : 0;
+			if (n_shards <= 0 || shard < 0 || shard >= n_shards) {
+				fprintf(stderr, "[E::%s] option '-S' takes I/N with 0 <= I < N\n", __func__);
 				return 1;
 			}
-			mr = mr_restore(fp);
-			fclose(fp);
+		} else if (c == 'a') {
+			fn_mrg = realloc(fn_mrg, (n_mrg + 1) * sizeof(char*));
+			fn_mrg[n_mrg++] = optarg;
 		} else if (c == 'm') {
-			double x;
-			char *p;
-			x = strtod(optarg, &p);
-			if (*p == 'K' || *p == 'k') x *= 1024;
-			else if (*p == 'M' || *p == 'm') x *= 1024 * 1024;
-			else if (*p == 'G' || *p == 'g') x *= 1024 * 1024 * 1024;
+			double x = parse_size(optarg);
 			m = x? (int64_t)(x * .97) + 1 : 0;
+		} else if (c == 'E') budget = (int64_t)parse_size(optarg);
+		else if (c == 'O') fn_ckpt = optarg;
+		else if (c == 'k') ckpt_every = atoi(optarg) > 0? atoi(optarg) : 1;
+		else if (c == 'j') {
+			if ((fp_stat = fopen(optarg, "w")) == 0) {
+				fprintf(stderr, "[E::%s] fail to open file '%s' for writing\n", __func__, optarg);
+				return 1;
+			}
 		}
 	}
 
 	from_stdin = !isatty(fileno(stdin));
-	if (optind == argc && !from_stdin) {
+	if (optind == argc && !from_stdin && n_mrg == 0) {
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage:   ropebwt2-%s [options] <in.fq.gz>\n\n", ROPEBWT2_VERSION);
-		fprintf(stderr, "Options: -l INT     leaf block length [%d]\n", block_len);
+		fprintf(stderr, "Options: -l INT     leaf block length; blocks of %d bytes or longer keep rank checkpoints [%d]\n", RLE_CK_MIN_LEN, block_len);
 		fprintf(stderr, "         -n INT     max number children per internal node [%d]\n", max_nodes);
 		fprintf(stderr, "         -s         build BWT in the reverse lexicographical order (RLO)\n");
 		fprintf(stderr, "         -r         build BWT in RCLO, overriding -s \n");
 		fprintf(stderr, "         -m INT     batch size for multi-string indexing; 0 for single-string [10g]\n");
-		fprintf(stderr, "         -P         always use a single thread\n");
-		fprintf(stderr, "         -M INT     switch to single thread when < INT strings remain in a batch [%d]\n\n", 1000);
-		fprintf(stderr, "         -i FILE    read existing index in the FMR format from FILE, overriding -s/-r [null]\n");
+		fprintf(stderr, "         -E INT     size each batch to keep the index and the batch within INT bytes; -m caps the batch size [0]\n");
+		fprintf(stderr, "         -t INT     number of threads [%d]\n", n_threads);
+		fprintf(stderr, "         -P         always use a single thread (equivalent to -t1)\n");
+		fprintf(stderr, "         -z         keep each batch in 4 bits per symbol, halving the batch memory of -m\n");
+		fprintf(stderr, "         -u         insert identical strings in a batch together, as runs; requires -s or -r\n");
+		fprintf(stderr, "         -p         read the next batch while inserting the current one (doubling the batch memory)\n");
+		fprintf(stderr, "         -M INT     switch to single thread when < INT strings remain in a batch [%d]\n", 1000);
+		fprintf(stderr, "         -e INT     build on flat arrays when the index is empty or 4x smaller than the batch and reads average <=INT bp; 0 to disable [%d]\n", MR_BCR_MAX_LEN);
+		fprintf(stderr, "         -H         allocate memory in 2MB huge pages\n");
+		fprintf(stderr, "         -G         allocate memory in 1GB chunks, using 1GB huge pages if reserved (implies -H)\n");
+		fprintf(stderr, "         -U         report memory usage per rope\n");
+		fprintf(stderr, "         -O FILE    checkpoint the index to FILE in the background; rerunning the command resumes from FILE [null]\n");
+		fprintf(stderr, "         -k INT     write a checkpoint after every INT batches [%d]\n", ckpt_every);
+		fprintf(stderr, "         -j FILE    write statistics accumulated since the start to FILE after each batch, in JSON lines [null]\n");
+		fprintf(stderr, "         -c FLOAT   repack the index to FLOAT full after each batch and before output; 0 to disable [0]\n\n");
+		fprintf(stderr, "         -i FILE    read existing index from FILE in FMR, overriding -s/-r, or in FMD, CRLF or plain text [null]\n");
+		fprintf(stderr, "         -a FILE    merge the FMR index in FILE into the constructed index; can be repeated [null]\n");
+		fprintf(stderr, "                    with -a, input is read only if given on the command line ('-' for stdin)\n");
 		fprintf(stderr, "         -L         input in the one-sequence-per-line format\n");
 		fprintf(stderr, "         -F         skip forward strand\n");
 		fprintf(stderr, "         -R         skip reverse strand\n");
 		fprintf(stderr, "         -N         skip sequences containing ambiguous bases\n");
 		fprintf(stderr, "         -x INT     cut at ambiguous bases and discard segment with length <INT [0]\n");
 		fprintf(stderr, "         -C         cut one base if forward==reverse\n");
-		fprintf(stderr, "         -q INT     hard mask bases with QUAL<INT [0]\n\n");
+		fprintf(stderr, "         -q INT     hard mask bases with QUAL<INT [0]\n");
+		fprintf(stderr, "         -S I/N     build shard I of N: take every N-th sequence starting from the I-th (0-based) [0/1]\n\n");
 		fprintf(stderr, "         -o FILE    write output to FILE [stdout]\n");
 		fprintf(stderr, "         -b         dump the index in the binary FMR format\n");
+		fprintf(stderr, "         -D         dump the index in the memory-mappable FMR format, which -i maps without parsing\n");
 		fprintf(stderr, "         -d         dump the index in fermi's FMD format\n");
+		fprintf(stderr, "         -Z         dump a static, rank-only index for queries; it cannot be read back with -i\n");
 		fprintf(stderr, "         -T         output the index in the Newick format (for debugging)\n\n");
 		return 1;
 	}
@@ -167,14 +940,63 @@ int main_ropebwt2(int argc, char *argv[])
 		fprintf(stderr, "[E::%s] option '-x' cannot be used with '-m0'\n", __func__);
 		return 1;
 	}
+	if ((flag & FLAG_DUP) && m == 0) {
+		fprintf(stderr, "[E::%s] option '-u' cannot be used with '-m0'\n", __func__);
+		return 1;
+	}
+	if (budget && m == 0) {
+		fprintf(stderr, "[E::%s] option '-E' cannot be used with '-m0'\n", __func__);
+		return 1;
+	}
+	if (fp_stat && m == 0) {
+		fprintf(stderr, "[E::%s] option '-j' cannot be used with '-m0'\n", __func__);
+		return 1;
+	}
+	if (fn_ckpt && m == 0) {
+		fprintf(stderr, "[E::%s] option '-O' cannot be used with '-m0'\n", __func__);
+		return 1;
+	}
+	if (fn_idx && (mr = load_index(fn_idx, so, max_nodes, block_len, mem_mode, compact > 0.? compact : 1.)) == 0)
+		return 1;
+	if (fn_ckpt) { // the checkpoint holds any index given by -i, too
+		mrope_t *ck = 0;
+		int ret = ckpt_resume(fn_ckpt, optind < argc? argv[optind] : "-", &ck, &n_skip);
+		if (ret < 0) return 1;
+		if (ret > 0) {
+			if (mr) mr_destroy(mr);
+			mr = ck;
+			if (verbose >= 3) fprintf(stderr, "[M::%s] resuming from checkpoint '%s'; skipping the first %ld sequences\n", __func__, fn_ckpt, (long)n_skip);
+		}
+	}
 
 	liftrlimit();
 	if (mr == 0) mr = mr_init(max_nodes, block_len, so);
+	if ((flag & FLAG_DUP) && mr->so == MR_SO_IO) { // copies would come together, not in the input order
+		fprintf(stderr, "[E::%s] option '-u' requires '-s' or '-r', or an index in RLO or RCLO\n", __func__);
+		return 1;
+	}
 	if (thr_min > 0) mr_thr_min(mr, thr_min);
-	fp = optind < argc && strcmp(argv[optind], "-")? gzopen(argv[optind], "rb") : gzdopen(fileno(stdin), "rb");
-	ks = kseq_init(fp);
+	if (bcr_max_len >= 0) mr_bcr_max_len(mr, bcr_max_len);
+	if (mem_mode) mr_mem_mode(mr, mem_mode);
+	if (n_threads <= 1) flag &= ~FLAG_PIPE;
+	memset(&bt, 0, sizeof(batch_t));
+	memset(&dd, 0, sizeof(dedup_t));
+	bt.mr = mr, bt.pk = !!(flag & FLAG_PACK), bt.n_threads = n_threads, bt.compact = compact, bt.budget = budget, bt.fp_stat = fp_stat;
+	bt.ck.fn = fn_ckpt, bt.ck.fn_in = optind < argc? argv[optind] : "-", bt.ck.every = ckpt_every;
+	if (budget) {
+		batch_measure(&bt);
+		if (bt.mem + BATCH_MIN_SIZE >= budget)
+			fprintf(stderr, "[W::%s] the index alone takes %.1f MB, nearly all of the memory budget\n", __func__, bt.mem / 1048576.);
+	}
+	if (optind < argc || n_mrg == 0) {
+		if ((fp = mtgz_open(optind < argc? argv[optind] : 0, n_threads)) == 0) {
+			fprintf(stderr, "[E::%s] fail to open file '%s'\n", __func__, optind < argc? argv[optind] : "-");
+			return 1;
+		}
+		ks = kseq_init(fp);
+	}
 	ct = cputime(); rt = realtime();
-	for (;;) {
+	while (ks) {
 		int l;
 		uint8_t *s;
 		if (flag & FLAG_LINE) { // read a line
@@ -185,6 +1007,8 @@ int main_ropebwt2(int argc, char *argv[])
 			ks->seq.l = i;
 			ks->qual.l = 0;
 		} else if (kseq_read(ks) < 0) break; // read fasta/fastq
+		if (++n_seqs <= n_skip) continue; // already in the index restored from a checkpoint
+		if (n_shards > 1 && (n_seqs - 1) % n_shards != shard) continue; // another shard takes this sequence
 		l = ks->seq.l;
 		s = (uint8_t*)ks->seq.s;
 		for (i = 0; i < l; ++i) // change encoding
@@ -221,10 +1045,17 @@ int main_ropebwt2(int argc, char *argv[])
 			ks->seq.l = l;
 		}
 		if (flag & FLAG_FOR) {
-			if (m) kputsn((char*)ks->seq.s, ks->seq.l + 1, &buf);
-			else mr_insert1(mr, s);
+			if (m) {
+				int64_t k0 = buf_len;
+				batch_put(&buf, &buf_len, flag&FLAG_PACK, (uint8_t*)ks->seq.s, ks->seq.l + 1);
+				n_strs += (flag & FLAG_DUP)? dup_put(&dd, &buf, &buf_len, flag&FLAG_PACK, k0) : 1;
+			} else mr_insert1(mr, s);
 		}
-		if (flag & FLAG_REV) {
+		if ((flag & FLAG_REV) && m) { // write the reverse complement straight into the batch
+			int64_t k0 = buf_len;
+			batch_put_rc(&buf, &buf_len, flag&FLAG_PACK, s, l);
+			n_strs += (flag & FLAG_DUP)? dup_put(&dd, &buf, &buf_len, flag&FLAG_PACK, k0) : 1;
+		} else if (flag & FLAG_REV) {
 			for (i = 0; i < l>>1; ++i) {
 				int tmp = s[l-1-i];
 				tmp = (tmp >= 1 && tmp <= 4)? 5 - tmp : tmp;
@@ -232,22 +1063,19 @@ int main_ropebwt2(int argc, char *argv[])
 				s[i] = tmp;
 			}
 			if (l&1) s[i] = (s[i] >= 1 && s[i] <= 4)? 5 - s[i] : s[i];
-			if (m) kputsn((char*)ks->seq.s, ks->seq.l + 1, &buf);
-			else mr_insert1(mr, s);
-		}
-		if (m && buf.l >= m) {
-			double ct = cputime(), rt = realtime();
-			mr_insert_multi(mr, buf.l, (uint8_t*)buf.s, flag&FLAG_THR);
-			if (verbose >= 3) fprintf(stderr, "[M::%s] inserted %ld symbols in %.3f sec, %.3f CPU sec\n",
-					__func__, (long)buf.l, realtime() - rt, cputime() - ct);
-			buf.l = 0;
+			mr_insert1(mr, s);
 		}
+		if (m && (buf_len >= m || (budget && batch_full(&bt, &buf, buf_len, n_strs, flag&FLAG_DUP? &dd : 0))))
+			batch_insert(&bt, &buf, &buf_len, flag&FLAG_DUP? &dd : 0, n_seqs, flag&FLAG_PIPE, verbose), n_strs = 0;
 	}
-	if (m && buf.l) {
-		double ct = cputime(), rt = realtime();
-		mr_insert_multi(mr, buf.l, (uint8_t*)buf.s, flag&FLAG_THR);
-		if (verbose >= 3) fprintf(stderr, "[M::%s] inserted %ld symbols in %.3f sec, %.3f CPU sec\n",
-				__func__, (long)buf.l, realtime() - rt, cputime() - ct);
+	bt.at_eof = 1;
+	if (m && buf_len) batch_insert(&bt, &buf, &buf_len, flag&FLAG_DUP? &dd : 0, n_seqs, 0, verbose);
+	batch_wait(&bt, verbose);
+	if (n_mrg && (mr = merge_fmr(mr, n_mrg, fn_mrg, compact > 0.? compact : 1., n_threads, mem_mode, verbose)) == 0)
+		return 1;
+	if (compact > 0. && bt.buf.s == 0 && n_mrg == 0) { // no batches; compact the index here
+		int64_t freed = mr_compact(mr, compact);
+		if (verbose >= 3) fprintf(stderr, "[M::%s] compaction changed the index memory by %+.1f MB\n", __func__, -freed / 1048576.);
 	}
 	if (verbose >= 3) {
 		int64_t c[6];
@@ -256,12 +1084,40 @@ int main_ropebwt2(int argc, char *argv[])
 		fprintf(stderr, "[M::%s] symbol counts: ($, A, C, G, T, N) = (%ld, %ld, %ld, %ld, %ld, %ld)\n", __func__,
 				(long)c[0], (long)c[1], (long)c[2], (long)c[3], (long)c[4], (long)c[5]);
 	}
-	free(buf.s);
-	kseq_destroy(ks);
-	gzclose(fp);
+	if (verbose >= 4 && mr->st.n_par_rounds) {
+		const mrstat_t *st = &mr->st;
+		fprintf(stderr, "[M::%s] %ld of %ld rounds in parallel; %.3f sec in total, %.3f sec at most per round\n", __func__,
+				(long)st->n_par_rounds, (long)st->n_rounds, st->t_par, st->t_max_round);
+		fprintf(stderr, "[M::%s] %.3f sec idle on the master thread; %ld blocking waits at barriers\n", __func__, st->t_idle, (long)st->n_sleeps);
+	}
+	if (flag & FLAG_MEMU) {
+		for (i = 0; i < 6; ++i) {
+			rpmemstat_t sn, sl;
+			rope_mem_stat(mr->r[i], &sn, &sl);
+			fprintf(stderr, "[M::%s] rope '%c': nodes %.1f/%.1f MB in %ld chunks (%ld huge); leaves %.1f/%.1f MB in %ld chunks (%ld huge)\n",
+					__func__, "$ACGTN"[i], sn.used / 1048576., sn.reserved / 1048576., (long)sn.n_chunks, (long)sn.n_huge,
+					sl.used / 1048576., sl.reserved / 1048576., (long)sl.n_chunks, (long)sl.n_huge);
+		}
+	}
+	free(buf.s); free(bt.buf.s);
+	dup_destroy(&dd); dup_destroy(&bt.dd);
+	free(fn_mrg);
+	if (fp_stat) fclose(fp_stat);
+	if (ks) kseq_destroy(ks);
+	if (fp && mtgz_close(fp) < 0) {
+		fprintf(stderr, "[E::%s] the input is truncated or corrupted\n", __func__);
+		mr_destroy(mr);
+		return 1;
+	}
 
 	if (flag & FLAG_BIN) {
 		mr_dump(mr, stdout);
+	} else if (flag & FLAG_MMAP) {
+		mr_dump_mmap(mr, stdout);
+	} else if (flag & FLAG_FRZ) {
+		mrfrz_t *f = mr_freeze(mr);
+		if (mr_frz_dump(f, stdout) < 0) fprintf(stderr, "[E::%s] failed to write the frozen index\n", __func__);
+		mr_frz_destroy(f);
 	} else if (flag & FLAG_TREE) {
 		mr_print_tree(mr);
 	} else {
@@ -287,34 +1143,46 @@ int main_ropebwt2(int argc, char *argv[])
 			crlf = crlf_create(0, 6, dectab, crlf_write_RL53, 1, &tag);
 			free(tag.data);
 		}
-		mr_itr_first(mr, &itr, 1);
-		while ((block = mr_itr_next_block(&itr)) != 0) {
-			const uint8_t *q = block + 2, *end = block + 2 + *rle_nptr(block);
-			if (flag & FLAG_RLD) {
-				while (q < end) {
-					int c = 0;
-					int64_t l;
-					rle_dec1(q, c, l);
-					rld_enc(e, &di, l, c);
-				}
-			} else if (flag & FLAG_CRLF) {
-				while (q < end) {
-					int c = 0;
-					int64_t l;
-					rle_dec1(q, c, l);
-					crlf_write(crlf, c, l);
-				}
-			} else {
-				while (q < end) {
-					int c = 0;
-					int64_t j, l;
-					rle_dec1(q, c, l);
-					for (j = 0; j < l; ++j) putchar("$ACGTN"[c]);
+		if ((flag & (FLAG_RLD|FLAG_CRLF)) && n_threads > 1) {
+			exp_segs(mr, flag, n_threads, e, &di, crlf);
+		} else {
+			char *txt = malloc(EXP_TXT_BUF);
+			int tl = 0;
+			mr_itr_first(mr, &itr, 1);
+			while ((block = mr_itr_next_block(&itr)) != 0) {
+				const uint8_t *q = block + 2, *end = block + 2 + *rle_nptr(block);
+				if (flag & FLAG_RLD) {
+					while (q < end) {
+						int c = 0;
+						int64_t l;
+						rle_dec1(q, c, l);
+						rld_enc(e, &di, l, c);
+					}
+				} else if (flag & FLAG_CRLF) {
+					while (q < end) {
+						int c = 0;
+						int64_t l;
+						rle_dec1(q, c, l);
+						crlf_write(crlf, c, l);
+					}
+				} else {
+					while (q < end) {
+						int c = 0;
+						int64_t l, k;
+						rle_dec1(q, c, l);
+						for (; l > 0; l -= k) { // fill the buffer with one memset() per run
+							k = l < EXP_TXT_BUF - tl? l : EXP_TXT_BUF - tl;
+							memset(txt + tl, "$ACGTN"[c], k);
+							if ((tl += k) == EXP_TXT_BUF) fwrite(txt, 1, tl, stdout), tl = 0;
+						}
+					}
 				}
 			}
+			fwrite(txt, 1, tl, stdout);
+			free(txt);
 		}
 		if (flag & FLAG_RLD) {
-			rld_enc_finish(e, &di);
+			rld_enc_finish_mt(e, &di, n_threads);
 			fprintf(stderr, "[M::%s] rld: (tot, $, A, C, G, T, N) = (%ld, %ld, %ld, %ld, %ld, %ld, %ld)\n", __func__,
 					(long)e->mcnt[0], (long)e->mcnt[1], (long)e->mcnt[2], (long)e->mcnt[3], (long)e->mcnt[4], (long)e->mcnt[5], (long)e->mcnt[6]);
 			rld_dump(e, "-");
@@ -323,6 +1191,13 @@ int main_ropebwt2(int argc, char *argv[])
 		} else if (!(flag & FLAG_BIN)) putchar('\n');
 	}
 	mr_destroy(mr);
+	if (fn_ckpt) {
+		if (fflush(stdout) != 0) {
+			fprintf(stderr, "[E::%s] failed to write the output; checkpoint '%s' is kept\n", __func__, fn_ckpt);
+			return 1;
+		}
+		ckpt_done(&bt.ck);
+	}
 	return 0;
 }
 
@@ -5,12 +5,18 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rle.h"
 #include "mrope.h"
 
 /*******************************
  *** Single-string insertion ***
  *******************************/
 
+static const uint8_t mr_order[2][6] = { { 0, 1, 2, 3, 4, 5 }, { 0, 4, 3, 2, 1, 5 } }; // symbols in the order of suffixes in IO/RLO and in RCLO
+
 mrope_t *mr_init(int max_nodes, int block_len, int sorting_order)
 {
 	int a;
@@ -19,6 +25,7 @@ mrope_t *mr_init(int max_nodes, int block_len, int sorting_order)
 	r = calloc(1, sizeof(mrope_t));
 	r->so = sorting_order;
 	r->thr_min = 1000;
+	r->bcr_max_len = MR_BCR_MAX_LEN;
 	for (a = 0; a != 6; ++a)
 		r->r[a] = rope_init(max_nodes, block_len);
 	return r;
@@ -29,6 +36,7 @@ void mr_destroy(mrope_t *r)
 	int a;
 	for (a = 0; a != 6; ++a)
 		if (r->r[a]) rope_destroy(r->r[a]);
+	if (r->mm) munmap(r->mm, r->mm_size);
 	free(r);
 }
 
@@ -39,11 +47,51 @@ int mr_thr_min(mrope_t *r, int thr_min)
 	return r->thr_min;
 }
 
+int mr_bcr_max_len(mrope_t *r, int max_len)
+{
+	if (max_len >= 0)
+		r->bcr_max_len = max_len;
+	return r->bcr_max_len;
+}
+
+void mr_mem_mode(mrope_t *r, int mode)
+{
+	int a;
+	for (a = 0; a != 6; ++a)
+		rope_mem_mode(r->r[a], mode);
+}
+
+int64_t mr_compact(mrope_t *r, double fill)
+{
+	int a;
+	int64_t freed = 0;
+	for (a = 0; a != 6; ++a) {
+		rpmemstat_t n0, l0, n1, l1;
+		rope_mem_stat(r->r[a], &n0, &l0);
+		rope_compact(r->r[a], fill);
+		rope_mem_stat(r->r[a], &n1, &l1);
+		freed += n0.reserved + l0.reserved - n1.reserved - l1.reserved;
+	}
+	return freed;
+}
+
+mrope_t *mr_dup(const mrope_t *mr, double fill)
+{
+	int a;
+	mrope_t *r;
+	r = calloc(1, sizeof(mrope_t));
+	r->so = mr->so, r->thr_min = mr->thr_min, r->bcr_max_len = mr->bcr_max_len;
+	for (a = 0; a != 6; ++a)
+		r->r[a] = rope_dup(mr->r[a], fill);
+	return r;
+}
+
 int64_t mr_insert1(mrope_t *r, const uint8_t *str)
 {
 	int64_t tl[6], tu[6], l, u;
 	const uint8_t *p;
-	int b, is_srt = (r->so != MR_SO_IO), is_comp = (r->so == MR_SO_RCLO);
+	const uint8_t *ord = mr_order[r->so == MR_SO_RCLO];
+	int b, is_srt = (r->so != MR_SO_IO);
 	for (u = 0, b = 0; b != 6; ++b) u += r->r[b]->c[0];
 	l = is_srt? 0 : u;
 	for (p = str, b = 0; *p; b = *p++) {
@@ -51,10 +99,7 @@ int64_t mr_insert1(mrope_t *r, const uint8_t *str)
 		if (l != u) {
 			int64_t cnt = 0;
 			rope_rank2a(r->r[b], l, u, tl, tu);
-			if (is_comp && *p != 5) {
-				for (a = 4; a > *p; --a) l += tu[a] - tl[a];
-				l += tu[0] - tl[0];
-			} else for (a = 0; a < *p; ++a) l += tu[a] - tl[a];
+			for (a = 0; ord[a] != *p; ++a) l += tu[ord[a]] - tl[ord[a]];
 			rope_insert_run(r->r[b], l, *p, 1, 0);
 			while (--b >= 0) cnt += r->r[b]->c[*p];
 			l = cnt + tl[*p]; u = cnt + tu[*p];
@@ -104,6 +149,127 @@ void mr_rank2a(const mrope_t *mr, int64_t x, int64_t y, int64_t *cx, int64_t *cy
 	for (b = 0; b < 6; ++b) cy[b] += c[b];
 }
 
+void mr_rank2a_batch(const mrope_t *mr, int64_t n, const int64_t *x, const int64_t *y, int64_t *cx, int64_t *cy)
+{
+	int64_t i, j, k, z[7], acc[7][6], *tx, *ty;
+	int a, b;
+	for (a = 0, z[0] = 0, memset(acc[0], 0, 48); a < 6; ++a) { // z[a]: start of rope $a; acc[a]: counts before rope $a
+		const int64_t *ca = mr->r[a]->c;
+		z[a+1] = z[a] + ca[0] + ca[1] + ca[2] + ca[3] + ca[4] + ca[5];
+		for (b = 0; b < 6; ++b) acc[a+1][b] = acc[a][b] + ca[b];
+	}
+	tx = malloc(n * 8 * 2); ty = tx + n;
+	for (i = 0; i < n; i = j) { // find queries falling in the same rope, and query them together
+		for (a = 0; a < 5 && z[a+1] < x[i]; ++a); // the same rule as in mr_rank2a()
+		for (j = i; j < n; ++j) {
+			if (x[j] < z[a] || x[j] > z[a+1] || (x[j] == z[a] && a > 0)) break;
+			if (y && y[j] >= 0 && y[j] > z[a+1]) break;
+			tx[j - i] = x[j] - z[a];
+			if (y) ty[j - i] = y[j] >= 0? y[j] - z[a] : -1;
+		}
+		if (j == i) { // [x,y) spans multiple ropes
+			mr_rank2a(mr, x[i], y? y[i] : -1, cx + i * 6, cy? cy + i * 6 : 0);
+			j = i + 1;
+			continue;
+		}
+		rope_rank2a_batch(mr->r[a], j - i, tx, y? ty : 0, cx + i * 6, cy? cy + i * 6 : 0);
+		for (k = i; k < j; ++k) {
+			for (b = 0; b < 6; ++b) cx[k*6+b] += acc[a][b];
+			if (cy && y && y[k] >= x[k])
+				for (b = 0; b < 6; ++b) cy[k*6+b] += acc[a][b];
+		}
+	}
+	free(tx);
+}
+
+void mr_extend(const mrope_t *mr, const mrintv_t *ik, mrintv_t ok[6], int is_back)
+{
+	int64_t tk[6], tl[6], ac[7];
+	int i;
+	mr_get_ac(mr, ac);
+	mr_rank2a(mr, ik->x[!is_back], ik->x[!is_back] + ik->x[2], tk, tl);
+	for (i = 0; i < 6; ++i) {
+		ok[i].x[!is_back] = ac[i] + tk[i];
+		ok[i].x[2] = (tl[i] -= tk[i]);
+		ok[i].info = 0;
+	}
+	ok[0].x[is_back] = ik->x[is_back];
+	ok[4].x[is_back] = ok[0].x[is_back] + tl[0];
+	ok[3].x[is_back] = ok[4].x[is_back] + tl[4];
+	ok[2].x[is_back] = ok[3].x[is_back] + tl[3];
+	ok[1].x[is_back] = ok[2].x[is_back] + tl[2];
+	ok[5].x[is_back] = ok[1].x[is_back] + tl[1];
+}
+
+/*****************
+ *** Snapshots ***
+ *****************/
+
+typedef struct mrsnapv_s { // one copy of the index
+	mrope_t *mr;
+	int n_refs;
+	struct mrsnapv_s *next;
+} mrsnapv_t;
+
+struct mrsnap_s {
+	pthread_mutex_t mtx;
+	mrsnapv_t *cur; // the latest copy
+	mrsnapv_t *old; // replaced copies still held by readers
+};
+
+mrsnap_t *mr_snap_init(void)
+{
+	mrsnap_t *s;
+	s = calloc(1, sizeof(mrsnap_t));
+	pthread_mutex_init(&s->mtx, 0);
+	return s;
+}
+
+void mr_snap_destroy(mrsnap_t *s)
+{
+	assert(s->old == 0 && (s->cur == 0 || s->cur->n_refs == 0));
+	if (s->cur) mr_destroy(s->cur->mr), free(s->cur);
+	pthread_mutex_destroy(&s->mtx);
+	free(s);
+}
+
+void mr_snap_publish(mrsnap_t *s, const mrope_t *mr, double fill)
+{
+	mrsnapv_t *v, *f = 0;
+	v = calloc(1, sizeof(mrsnapv_t));
+	v->mr = mr_dup(mr, fill); // copy outside the lock; readers keep using the current copy meanwhile
+	pthread_mutex_lock(&s->mtx);
+	if (s->cur && s->cur->n_refs > 0) s->cur->next = s->old, s->old = s->cur;
+	else f = s->cur;
+	s->cur = v;
+	pthread_mutex_unlock(&s->mtx);
+	if (f) mr_destroy(f->mr), free(f);
+}
+
+const mrope_t *mr_snap_acquire(mrsnap_t *s)
+{
+	mrope_t *mr = 0;
+	pthread_mutex_lock(&s->mtx);
+	if (s->cur) ++s->cur->n_refs, mr = s->cur->mr;
+	pthread_mutex_unlock(&s->mtx);
+	return mr;
+}
+
+void mr_snap_release(mrsnap_t *s, const mrope_t *mr)
+{
+	mrsnapv_t *v, **p, *f = 0;
+	pthread_mutex_lock(&s->mtx);
+	if (s->cur && s->cur->mr == mr) --s->cur->n_refs;
+	else {
+		for (p = &s->old; *p && (*p)->mr != mr; p = &(*p)->next);
+		assert(*p); // $mr is not a snapshot in $s
+		v = *p;
+		if (--v->n_refs == 0) *p = v->next, f = v;
+	}
+	pthread_mutex_unlock(&s->mtx);
+	if (f) mr_destroy(f->mr), free(f);
+}
+
 /**********************
  *** Mrope iterator ***
  **********************/
@@ -148,9 +314,10 @@ mrope_t *mr_restore(FILE *fp)
 	uint8_t magic[4];
 	int64_t tot, c[6];
 	int i;
-	fread(magic, 1, 4, fp);
+	if (fread(magic, 1, 4, fp) != 4 || magic[0] != 'R' || magic[1] != 'B' || magic[2] > 2) return 0;
 	mr = calloc(1, sizeof(mrope_t));
 	mr->so = magic[3];
+	mr->bcr_max_len = MR_BCR_MAX_LEN;
 	for (i = 0; i < 6; ++i)
 		mr->r[i] = rope_restore(fp);
 	tot = mr_get_c(mr, c);
@@ -159,6 +326,51 @@ mrope_t *mr_restore(FILE *fp)
 	return mr;
 }
 
+void mr_dump_mmap(const mrope_t *mr, FILE *fp)
+{
+	int i;
+	int64_t off = 4;
+	fwrite("RB\3", 1, 3, fp);
+	fwrite(&mr->so, 1, 1, fp);
+	for (i = 0; i < 6; ++i)
+		rope_dump_mmap(mr->r[i], fp, &off);
+}
+
+mrope_t *mr_restore_mmap(const char *fn)
+{
+	mrope_t *mr;
+	struct stat st;
+	uint8_t *base;
+	int64_t off = 4, c[6];
+	int fd, i;
+	if ((fd = open(fn, O_RDONLY)) < 0) return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < 4) {
+		close(fd);
+		return 0;
+	}
+	base = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return 0;
+	if (memcmp(base, "RB\3", 3) != 0 || base[3] > MR_SO_RCLO) {
+		munmap(base, st.st_size);
+		return 0;
+	}
+	mr = calloc(1, sizeof(mrope_t));
+	mr->so = base[3];
+	mr->thr_min = 1000, mr->bcr_max_len = MR_BCR_MAX_LEN;
+	mr->mm = base, mr->mm_size = st.st_size;
+	for (i = 0; i < 6; ++i)
+		if ((mr->r[i] = rope_restore_mmap(base, st.st_size, &off)) == 0) {
+			fprintf(stderr, "[E::%s] file '%s' is corrupted\n", __func__, fn);
+			mr_destroy(mr);
+			return 0;
+		}
+	mr_get_c(mr, c);
+	fprintf(stderr, "[M::%s] ($, A, C, G, T, N) = (%ld, %ld, %ld, %ld, %ld, %ld)\n", __func__,
+			(long)c[0], (long)c[1], (long)c[2], (long)c[3], (long)c[4], (long)c[5]);
+	return mr;
+}
+
 void mr_print_tree(const mrope_t *mr)
 {
 	int a;
@@ -167,61 +379,437 @@ void mr_print_tree(const mrope_t *mr)
 	putchar('\n');
 }
 
+/********************
+ *** Bulk loading ***
+ ********************/
+
+struct mrbuild_s {
+	mrope_t *mr;
+	double fill;
+	int a; // the bucket being loaded; 6 when all are done
+	int err;
+	int64_t ac[7], pos; // bucket boundaries, and the number of symbols given
+	int64_t c[6]; // number of each symbol given
+	rpbuild_t *rb; // builder of bucket $a
+};
+
+static void mr_build_next(mrbuild_t *b) // finish bucket $a and move to the next one
+{
+	if (b->rb) rope_build_finish(b->rb, b->mr->r[b->a]);
+	else rope_build_finish(rope_build_init(b->mr->r[b->a], b->fill), b->mr->r[b->a]); // an empty bucket
+	b->rb = 0, ++b->a;
+}
+
+mrbuild_t *mr_build_init(mrope_t *mr, const int64_t c[6], double fill)
+{
+	mrbuild_t *b;
+	int a;
+	assert(mr->mm == 0);
+	b = calloc(1, sizeof(mrbuild_t));
+	b->mr = mr, b->fill = fill;
+	for (a = 1, b->ac[0] = 0; a <= 6; ++a) b->ac[a] = b->ac[a-1] + c[a-1];
+	return b;
+}
+
+void mr_build_run(mrbuild_t *b, int c, int64_t l)
+{
+	if (c < 0 || c >= 6 || l < 0) {
+		b->err = 1;
+		return;
+	}
+	b->c[c] += l;
+	while (l > 0) {
+		int64_t k;
+		while (b->a < 6 && b->pos == b->ac[b->a+1]) mr_build_next(b);
+		if (b->a == 6) { // more symbols than counted
+			b->err = 1;
+			return;
+		}
+		if (b->rb == 0) b->rb = rope_build_init(b->mr->r[b->a], b->fill);
+		k = b->ac[b->a+1] - b->pos < l? b->ac[b->a+1] - b->pos : l;
+		rope_build_run(b->rb, c, k);
+		b->pos += k, l -= k;
+	}
+}
+
+int mr_build_finish(mrbuild_t *b)
+{
+	int a, ret;
+	while (b->a < 6) mr_build_next(b);
+	ret = b->err? -1 : 0;
+	for (a = 0; a < 6; ++a)
+		if (b->c[a] != b->ac[a+1] - b->ac[a]) ret = -1;
+	free(b);
+	return ret;
+}
+
+/********************
+ *** Frozen index ***
+ ********************/
+
+#define MR_FRZ_HDR 128 // bytes before the blocks in a dumped frozen index
+
+typedef struct { // append runs to a frozen index
+	mrfrz_t *f;
+	int64_t m_blk, m_mb, m_sb; // allocated blocks, groups and superblocks
+	int64_t sc[6], mc[6], bc[6]; // counts before the current superblock, group in it and block in the group
+	int u; // bytes used in the current block
+	int c;
+	int64_t l; // the pending run
+} mrfwr_t;
+
+static void frz_new_blk(mrfwr_t *w) // start the next block
+{
+	mrfrz_t *f = w->f;
+	mrfblk_t *b;
+	int a;
+	if (f->n_blk == w->m_blk) { // realloc() does not keep the alignment
+		mrfblk_t *p;
+		w->m_blk = w->m_blk? w->m_blk<<1 : 1024;
+		if (posix_memalign((void**)&p, 64, w->m_blk * sizeof(mrfblk_t)) != 0) abort();
+		if (f->n_blk) memcpy(p, f->blk, f->n_blk * sizeof(mrfblk_t));
+		free(f->blk);
+		f->blk = p;
+	}
+	if ((f->n_blk & ((1LL<<MR_FRZ_SB_SHIFT) - 1)) == 0) { // the first block of a superblock
+		if (f->n_sb == w->m_sb) {
+			w->m_sb = w->m_sb? w->m_sb<<1 : 16;
+			f->sc = realloc(f->sc, w->m_sb * 48);
+		}
+		for (a = 0; a < 6; ++a) w->sc[a] += w->mc[a] + w->bc[a], w->mc[a] = w->bc[a] = 0;
+		memcpy(f->sc[f->n_sb++], w->sc, 48);
+	}
+	if ((f->n_blk & ((1<<MR_FRZ_MB_SHIFT) - 1)) == 0) { // the first block of a group
+		if (f->n_mb == w->m_mb) {
+			w->m_mb = w->m_mb? w->m_mb<<1 : 1024;
+			f->mc = realloc(f->mc, w->m_mb * 24);
+		}
+		for (a = 0; a < 6; ++a) w->mc[a] += w->bc[a], w->bc[a] = 0;
+		for (a = 0; a < 6; ++a) f->mc[f->n_mb][a] = w->mc[a];
+		++f->n_mb;
+	}
+	b = &f->blk[f->n_blk++];
+	memset(b, 0, sizeof(mrfblk_t));
+	for (a = 0; a < 6; ++a) b->c[a] = w->bc[a];
+	w->u = 0;
+}
+
+static void frz_flush(mrfwr_t *w) // write the pending run, cut at block boundaries
+{
+	mrfrz_t *f = w->f;
+	while (w->l > 0) {
+		mrfblk_t *b = &f->blk[f->n_blk - 1];
+		uint8_t tmp[8];
+		int64_t k = MR_FRZ_BLK_MAX - b->n < w->l? MR_FRZ_BLK_MAX - b->n : w->l;
+		int n = k? rle_enc1(tmp, w->c, k) : 0;
+		if (k == 0 || w->u + n > MR_FRZ_RUN_BYTES) {
+			frz_new_blk(w);
+			continue;
+		}
+		memcpy(b->r + w->u, tmp, n);
+		w->u += n, b->n += k, w->bc[w->c] += k, w->l -= k;
+	}
+}
+
+mrfrz_t *mr_freeze(mrope_t *mr)
+{
+	mrfrz_t *f;
+	mrfwr_t w;
+	mritr_t itr;
+	const uint8_t *block;
+	int64_t i, j, pos;
+
+	f = calloc(1, sizeof(mrfrz_t));
+	f->so = mr->so;
+	f->tot = mr_get_c(mr, f->c);
+	memset(&w, 0, sizeof(mrfwr_t));
+	w.f = f;
+	frz_new_blk(&w);
+	mr_itr_first(mr, &itr, 0);
+	while ((block = mr_itr_next_block(&itr)) != 0) {
+		const uint8_t *q = block + 2, *end = block + 2 + *rle_nptr(block);
+		while (q < end) {
+			int c = 0;
+			int64_t l;
+			rle_dec1(q, c, l);
+			if (c != w.c) frz_flush(&w), w.c = c;
+			w.l += l;
+		}
+	}
+	frz_flush(&w);
+	assert(f->n_blk < 1LL<<32);
+	for (f->shift = 0; f->tot >> f->shift > f->n_blk; ++f->shift); // about one sample per block
+	f->n_smp = (f->tot >> f->shift) + 1;
+	f->smp = malloc(f->n_smp * 4);
+	for (i = j = pos = 0; i < f->n_blk; pos += f->blk[i++].n)
+		for (; j < f->n_smp && j << f->shift < pos + f->blk[i].n; ++j)
+			f->smp[j] = i;
+	for (; j < f->n_smp; ++j) f->smp[j] = f->n_blk - 1; // positions at the end
+	return f;
+}
+
+void mr_frz_destroy(mrfrz_t *f)
+{
+	if (f == 0) return;
+	if (f->mm) munmap(f->mm, f->mm_size);
+	else free(f->blk), free(f->mc), free(f->sc), free(f->smp);
+	free(f);
+}
+
+static inline void frz_blk_cnt(const mrfrz_t *f, int64_t i, int64_t cnt[6]) // counts before block $i
+{
+	const mrfblk_t *b = &f->blk[i];
+	const uint32_t *mc = f->mc[i >> MR_FRZ_MB_SHIFT];
+	const int64_t *sc = f->sc[i >> MR_FRZ_SB_SHIFT];
+	int a;
+	for (a = 0; a < 6; ++a) cnt[a] = sc[a] + mc[a] + b->c[a];
+}
+
+static inline const mrfblk_t *frz_find(const mrfrz_t *f, int64_t x, int64_t *pos, int64_t cnt[6]) // the block containing $x; $pos and $cnt at its start
+{
+	int64_t i = f->smp[x >> f->shift], p;
+	const mrfblk_t *b = &f->blk[i];
+	frz_blk_cnt(f, i, cnt);
+	p = cnt[0] + cnt[1] + cnt[2] + cnt[3] + cnt[4] + cnt[5];
+	if (x >= p + b->n) { // a later block; usually the next one
+		while (x >= p + b->n && i < f->n_blk - 1) p += b->n, ++b, ++i;
+		frz_blk_cnt(f, i, cnt);
+	}
+	*pos = p;
+	return b;
+}
+
+typedef struct { // decoding runs of a block
+	const uint8_t *p;
+	int c;
+	int64_t l; // symbols left in run $c
+} mrfdec_t;
+
+static inline void frz_count(mrfdec_t *d, int64_t k, int64_t cnt[6]) // add $k more symbols to $cnt
+{
+	while (k > 0) {
+		int64_t t;
+		if (d->l == 0) rle_dec1(d->p, d->c, d->l);
+		t = d->l < k? d->l : k;
+		cnt[d->c] += t, d->l -= t, k -= t;
+	}
+}
+
+void mr_frz_rank2a(const mrfrz_t *f, int64_t x, int64_t y, int64_t *cx, int64_t *cy)
+{
+	const mrfblk_t *b;
+	mrfdec_t d;
+	int64_t pos;
+	if (x >= f->tot) {
+		memcpy(cx, f->c, 48);
+		if (y >= 0) memcpy(cy, f->c, 48);
+		return;
+	}
+	b = frz_find(f, x, &pos, cx);
+	d.p = b->r, d.l = 0;
+	frz_count(&d, x - pos, cx);
+	if (y < 0) return;
+	if (y < pos + b->n) { // in the same block; continue decoding
+		memcpy(cy, cx, 48);
+		frz_count(&d, y - x, cy);
+	} else if (y >= f->tot) memcpy(cy, f->c, 48);
+	else {
+		b = frz_find(f, y, &pos, cy);
+		d.p = b->r, d.l = 0;
+		frz_count(&d, y - pos, cy);
+	}
+}
+
+void mr_frz_extend(const mrfrz_t *f, const mrintv_t *ik, mrintv_t ok[6], int is_back)
+{
+	int64_t tk[6], tl[6], ac[7];
+	int i;
+	for (i = 1, ac[0] = 0; i <= 6; ++i) ac[i] = ac[i-1] + f->c[i-1];
+	mr_frz_rank2a(f, ik->x[!is_back], ik->x[!is_back] + ik->x[2], tk, tl);
+	for (i = 0; i < 6; ++i) {
+		ok[i].x[!is_back] = ac[i] + tk[i];
+		ok[i].x[2] = (tl[i] -= tk[i]);
+		ok[i].info = 0;
+	}
+	ok[0].x[is_back] = ik->x[is_back];
+	ok[4].x[is_back] = ok[0].x[is_back] + tl[0];
+	ok[3].x[is_back] = ok[4].x[is_back] + tl[4];
+	ok[2].x[is_back] = ok[3].x[is_back] + tl[3];
+	ok[1].x[is_back] = ok[2].x[is_back] + tl[2];
+	ok[5].x[is_back] = ok[1].x[is_back] + tl[1];
+}
+
+int mr_frz_dump(const mrfrz_t *f, FILE *fp)
+{
+	uint8_t hdr[MR_FRZ_HDR];
+	int64_t x[11];
+	int32_t shift = f->shift;
+	memset(hdr, 0, MR_FRZ_HDR);
+	memcpy(hdr, "RB\4", 3);
+	hdr[3] = f->so;
+	x[0] = f->tot, x[1] = f->n_blk, x[2] = f->n_mb, x[3] = f->n_sb, x[4] = f->n_smp;
+	memcpy(x + 5, f->c, 48);
+	memcpy(hdr + 8, x, 88);
+	memcpy(hdr + 96, &shift, 4);
+	if (fwrite(hdr, 1, MR_FRZ_HDR, fp) != MR_FRZ_HDR) return -1;
+	if (fwrite(f->blk, sizeof(mrfblk_t), f->n_blk, fp) != f->n_blk) return -1;
+	if (fwrite(f->sc, 48, f->n_sb, fp) != f->n_sb) return -1; // 8-byte counts first to keep them aligned
+	if (fwrite(f->mc, 24, f->n_mb, fp) != f->n_mb) return -1;
+	if (fwrite(f->smp, 4, f->n_smp, fp) != f->n_smp) return -1;
+	return 0;
+}
+
+mrfrz_t *mr_frz_restore_mmap(const char *fn)
+{
+	mrfrz_t *f;
+	struct stat st;
+	uint8_t *base, *p;
+	int64_t x[11];
+	int32_t shift;
+	int fd;
+	if ((fd = open(fn, O_RDONLY)) < 0) return 0;
+	if (fstat(fd, &st) < 0 || st.st_size < MR_FRZ_HDR) {
+		close(fd);
+		return 0;
+	}
+	base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return 0;
+	memcpy(x, base + 8, 88);
+	memcpy(&shift, base + 96, 4);
+	if (memcmp(base, "RB\4", 3) != 0 || base[3] > MR_SO_RCLO || x[1] <= 0 || x[2] <= 0 || x[3] <= 0 || x[4] <= 0 || shift < 0 || shift > 63
+			|| MR_FRZ_HDR + x[1] * (int64_t)sizeof(mrfblk_t) + x[3] * 48 + x[2] * 24 + x[4] * 4 != st.st_size) {
+		munmap(base, st.st_size);
+		return 0;
+	}
+	f = calloc(1, sizeof(mrfrz_t));
+	f->so = base[3], f->shift = shift;
+	f->tot = x[0], f->n_blk = x[1], f->n_mb = x[2], f->n_sb = x[3], f->n_smp = x[4];
+	memcpy(f->c, x + 5, 48);
+	p = base + MR_FRZ_HDR;
+	f->blk = (mrfblk_t*)p, p += f->n_blk * sizeof(mrfblk_t);
+	f->sc = (int64_t(*)[6])p, p += f->n_sb * 48;
+	f->mc = (uint32_t(*)[6])p, p += f->n_mb * 24;
+	f->smp = (uint32_t*)p;
+	f->mm = base, f->mm_size = st.st_size;
+	return f;
+}
+
 /*****************************************
  *** Inserting multiple strings in RLO ***
  *****************************************/
 
-typedef struct {
-	uint64_t l;
-	uint64_t u:61, c:3;
-	const uint8_t *p;
+#define MR_POS_BITS 42 // bits for an interval bound; limits the total length of a multi-rope
+#define MR_OFF_BITS 41 // bits for an offset into the batch; limits the length of one batch
+
+typedef struct { // 16 bytes: a 42-bit interval [l,u), the current symbol and a 41-bit offset split into two words
+	uint64_t l:MR_POS_BITS, c:3, ph:(64-MR_POS_BITS-3);
+	uint64_t u:MR_POS_BITS, pl:(64-MR_POS_BITS);
 } triple64_t;
 
+#define tr_get_p(t) ((int64_t)(t)->ph << (64-MR_POS_BITS) | (t)->pl)
+#define tr_set_p(t, x) ((t)->ph = (uint64_t)(x) >> (64-MR_POS_BITS), (t)->pl = (x) & ((1ULL<<(64-MR_POS_BITS)) - 1))
+
+// With $mu, the top bits of the offset hold the number of copies minus one, and a batch is cut at 2^MR_MUL_SHIFT symbols
+#define MR_MUL_BITS  9
+#define MR_MUL_SHIFT (MR_OFF_BITS - MR_MUL_BITS)
+#define MR_MUL_MAX   (1LL<<MR_MUL_BITS) // more copies take several triples
+
+#define tr_off(p, mu) ((mu)? (p) & ((1LL<<MR_MUL_SHIFT) - 1) : (p))
+#define tr_mul(t, mu) ((mu)? (tr_get_p(t) >> MR_MUL_SHIFT) + 1 : 1)
+
 typedef const uint8_t *cstr_t;
 
+#define mr_sym(s, p, pk) ((pk)? (s)[(p)>>1] >> (((p)&1)<<2) & 0xf : (s)[p]) // symbol $p of a batch, packed in 4 bits if $pk
+
 #define rope_comp6(c) ((c) >= 1 && (c) <= 4? 5 - (c) : (c))
 
-static void mr_insert_multi_aux(rope_t *rope, int64_t m, triple64_t *a, int is_comp)
+#define MR_INS_BUF  256 // number of singleton insertions buffered for rope_insert_runs()
+#define MR_RANK_BUF 256 // number of groups whose ranks are computed together
+
+static void mr_ins_flush(rope_t *rope, int64_t n_ins, rpins_t *ins, const int64_t *idx, triple64_t *a, int mu, rpcache_t *cache)
+{ // insert buffered singletons; the j-th string of a run gets rank z+j, and all copies of a string the rank of the first
+	int64_t i, j, r;
+	rope_insert_runs(rope, n_ins, ins, cache);
+	for (i = j = 0; i < n_ins; ++i)
+		for (r = 0; r < ins[i].rl; r += tr_mul(&a[idx[j]], mu), ++j)
+			a[idx[j]].l = a[idx[j]].u = ins[i].z + r;
+}
+
+static void mr_insert_multi_aux(rope_t *rope, int64_t m, triple64_t *a, const uint8_t *s, int pk, int mu, int is_comp)
 {
-	int64_t k, beg;
+	const uint8_t *ord = mr_order[is_comp];
+	int64_t k, beg, n_ins = 0, n_idx = 0, idx[MR_INS_BUF], g_end[MR_RANK_BUF];
+	int64_t qx[MR_RANK_BUF], qy[MR_RANK_BUF], qcx[MR_RANK_BUF][6], qcy[MR_RANK_BUF][6];
+	rpins_t ins[MR_INS_BUF];
 	rpcache_t cache;
 	memset(&cache, 0, sizeof(rpcache_t));
-	for (k = 0; k != m; ++k) // set the base to insert
-		a[k].c = *a[k].p++;
-	for (k = 1, beg = 0; k <= m; ++k) {
-		if (k == m || a[k].u != a[k-1].u) {
+	for (k = 0; k != m; ++k) { // set the base to insert
+		int64_t p = tr_get_p(&a[k]);
+		a[k].c = mr_sym(s, tr_off(p, mu), pk);
+		tr_set_p(&a[k], p + 1);
+	}
+	for (beg = 0; beg < m;) {
+		int64_t D = 0, ic[6];
+		int g, n_g, n_q;
+		// Collect up to MR_RANK_BUF groups. As groups are sorted, the insertions of earlier groups all precede a later group.
+		// Ranks on the current rope at [l-D,u-D), where D is the number of strings in the earlier groups, plus the count
+		// of each symbol inserted by the earlier groups thus equal the ranks right before the group is inserted.
+		for (n_g = n_q = 0, k = beg; k < m && n_g < MR_RANK_BUF; ++n_g) {
+			int64_t e = k + 1, n_cp = tr_mul(&a[k], mu);
+			while (e < m && a[e].u == a[k].u) n_cp += tr_mul(&a[e], mu), ++e;
+			if (a[k].l != a[k].u) qx[n_q] = a[k].l - D, qy[n_q++] = a[k].u - D;
+			g_end[n_g] = e, D += n_cp, k = e;
+		}
+		rope_rank2a_batch(rope, n_q, qx, qy, qcx[0], qcy[0]);
+		memset(ic, 0, 48);
+		for (g = n_q = 0; g < n_g; ++g) {
 			int64_t x, i, l = a[beg].l, u = a[beg].u, tl[6], tu[6], c[6];
-			int start, end, step, b;
+			int j, b, n, t[6];
+			k = g_end[g];
 			if (l == u && k == beg + 1) { // special case; still works without the following block
-				a[beg].l = a[beg].u = rope_insert_run(rope, l, a[beg].c, 1, &cache);
+				int64_t n_cp = tr_mul(&a[beg], mu);
+				b = a[beg].c;
+				if (n_ins && ins[n_ins-1].a == b && ins[n_ins-1].x + ins[n_ins-1].rl == l) // the same symbol right after the last one: extend the run
+					ins[n_ins-1].rl += n_cp;
+				else ins[n_ins].x = l, ins[n_ins].a = b, ins[n_ins++].rl = n_cp;
+				idx[n_idx++] = beg;
+				ic[b] += n_cp;
 				beg = k;
-				continue;
-			} else if (l == u) {
+				if (n_idx < MR_INS_BUF) continue;
+			}
+			if (n_ins) {
+				mr_ins_flush(rope, n_ins, ins, idx, a, mu, &cache);
+				n_ins = n_idx = 0;
+			}
+			if (beg == k) continue;
+			if (l == u) {
 				memset(tl, 0, 48);
 				memset(tu, 0, 48);
-			} else rope_rank2a(rope, l, u, tl, tu);
+			} else {
+				for (b = 0; b < 6; ++b)
+					tl[b] = qcx[n_q][b] + ic[b], tu[b] = qcy[n_q][b] + ic[b];
+				++n_q;
+			}
 			memset(c, 0, 48);
-			for (i = beg; i < k; ++i) ++c[a[i].c];
-			// insert sentinel
-			if (c[0]) rope_insert_run(rope, l, 0, c[0], &cache);
-			// insert A/C/G/T
+			for (i = beg; i < k; ++i) c[a[i].c] += tr_mul(&a[i], mu);
+			// collect runs: sentinel, A/C/G/T in the sorting order and then N
+			n = 0;
+			if (c[0]) ins[n].x = l, ins[n].a = 0, ins[n++].rl = c[0];
 			x =  l + c[0] + (tu[0] - tl[0]);
-			if (is_comp) start = 4, end = 0, step = -1;
-			else start = 1, end = 5, step = 1;
-			for (b = start; b != end; b += step) {
-				int64_t size = tu[b] - tl[b];
-				if (c[b]) {
-					tl[b] = rope_insert_run(rope, x, b, c[b], &cache);
-					tu[b] = tl[b] + size;
-				}
-				x += c[b] + size;
+			for (j = 1; j < 6; ++j) {
+				b = ord[j];
+				if (c[b]) t[n] = b, ins[n].x = x, ins[n].a = b, ins[n++].rl = c[b];
+				x += c[b] + (tu[b] - tl[b]);
 			}
-			// insert N
-			if (c[5]) {
-				tu[5] -= tl[5];
-				tl[5] = rope_insert_run(rope, x, 5, c[5], &cache);
-				tu[5] += tl[5];
+			rope_insert_runs(rope, n, ins, &cache);
+			for (i = c[0]? 1 : 0; i < n; ++i) {
+				b = t[i];
+				tu[b] -= tl[b];
+				tl[b] = ins[i].z;
+				tu[b] += tl[b];
 			}
+			for (b = 0; b < 6; ++b) ic[b] += c[b];
 			// update a[]
 			for (i = beg; i < k; ++i) {
 				triple64_t *p = &a[i];
@@ -229,117 +817,859 @@ static void mr_insert_multi_aux(rope_t *rope, int64_t m, triple64_t *a, int is_c
 			}
 			beg = k;
 		}
+		if (n_ins) {
+			mr_ins_flush(rope, n_ins, ins, idx, a, mu, &cache);
+			n_ins = n_idx = 0;
+		}
 	}
 }
 
+/*************************************
+ *** Static BCR into an empty index ***
+ *************************************/
+
+// While the index is empty, each bucket is kept as a flat stream of runs instead of a rope. A round streams the old
+// runs of a bucket into a new buffer and puts the new symbols in between, which reads and writes memory in order.
+// This costs time proportional to the size of the bucket in every round, so it only pays off with short strings.
+
 typedef struct {
-	volatile int *n_fin_workers;
-	volatile int to_run;
-	int to_exit;
-	mrope_t *mr;
-	int b, is_comp;
-	int64_t m;
-	triple64_t *a;
-} worker_t;
-
-static void *worker(void *data)
-{
-	worker_t *w = (worker_t*)data;
-	struct timespec req, rem;
-	req.tv_sec = 0; req.tv_nsec = 1000000;
-	do {
-		while (!__sync_bool_compare_and_swap(&w->to_run, 1, 0)) nanosleep(&req, &rem); // wait for the signal from the master thread
-		if (w->m) mr_insert_multi_aux(w->mr->r[w->b], w->m, w->a, w->is_comp);
-		__sync_add_and_fetch(w->n_fin_workers, 1);
-	} while (!w->to_exit);
+	uint8_t *s; // runs in the 43+3 code, one after another
+	int64_t n, m; // bytes used and allocated
+	int64_t c[6]; // symbol counts
+} mrrle_t;
+
+typedef struct { // append runs, merging those of the same symbol
+	mrrle_t *r;
+	int c;
+	int64_t l; // the pending run
+} mrwr_t;
+
+typedef struct { // read runs in order
+	const uint8_t *p;
+	int c;
+	int64_t l; // symbols left in the current run
+} mrrd_t;
+
+static inline void wr_reserve(mrrle_t *r, int64_t n)
+{
+	if (r->n + n > r->m) {
+		r->m = r->n + n;
+		r->m += r->m >> 1;
+		r->s = realloc(r->s, r->m);
+	}
+}
+
+static inline void wr_flush(mrwr_t *w)
+{
+	if (w->l == 0) return;
+	wr_reserve(w->r, 8);
+	w->r->n += rle_enc1(w->r->s + w->r->n, w->c, w->l);
+	w->r->c[w->c] += w->l;
+	w->l = 0;
+}
+
+static inline void wr_run(mrwr_t *w, int c, int64_t l)
+{
+	if (c != w->c) wr_flush(w), w->c = c;
+	w->l += l;
+}
+
+static void rd_count(mrrd_t *r, int64_t k, int64_t cnt[6]) // skip $k symbols and count them
+{
+	while (k > 0) {
+		int64_t t;
+		if (r->l == 0) {
+			rle_dec1(r->p, r->c, r->l);
+		}
+		t = r->l < k? r->l : k;
+		cnt[r->c] += t, r->l -= t, k -= t;
+	}
+}
+
+static void rd_copy(mrrd_t *r, const uint8_t *end, int64_t k, mrwr_t *w, int64_t cnt[6]) // move $k symbols, or all if $k<0, to $w and count them
+{
+	const uint8_t *q, *q1 = 0, *st;
+	int64_t l = 0, bc[6];
+	int c = 0, is_cut = 0;
+	if (k == 0) return;
+	if (r->l > 0) { // the rest of the current run joins the pending run
+		l = k >= 0 && k < r->l? k : r->l;
+		wr_run(w, r->c, l);
+		cnt[r->c] += l, r->l -= l;
+		if (k >= 0 && (k -= l) == 0) return;
+	}
+	memset(bc, 0, 48);
+	for (st = q = r->p; q < end; q = q1) { // whole runs are copied as they are encoded
+		q1 = q;
+		rle_dec1(q1, c, l);
+		if (k >= 0 && l >= k) {
+			is_cut = 1;
+			break;
+		}
+		bc[c] += l;
+		if (k >= 0) k -= l;
+	}
+	if (q > st) {
+		wr_flush(w);
+		wr_reserve(w->r, q - st);
+		memcpy(w->r->s + w->r->n, st, q - st);
+		w->r->n += q - st;
+		for (c = 0; c < 6; ++c) w->r->c[c] += bc[c], cnt[c] += bc[c];
+	}
+	r->p = q;
+	if (is_cut) { // the first $k symbols of the next run become pending
+		rle_dec1(r->p, c, l);
+		wr_run(w, c, k);
+		cnt[c] += k;
+		r->c = c, r->l = l - k;
+	}
+}
+
+static void mr_bcr_aux(mrrle_t *rl, int64_t m, triple64_t *a, const uint8_t *s, int pk, int mu, int is_comp)
+{ // the same as mr_insert_multi_aux(), on a stream of runs; positions of the new symbols increase, so one pass suffices
+	int64_t k, beg, pos = 0, oc[6];
+	const uint8_t *end = rl->s + rl->n;
+	mrrle_t out;
+	mrwr_t w;
+	mrrd_t r;
+	for (k = 0; k != m; ++k) { // set the base to insert
+		int64_t p = tr_get_p(&a[k]);
+		a[k].c = mr_sym(s, tr_off(p, mu), pk);
+		tr_set_p(&a[k], p + 1);
+	}
+	memset(&out, 0, sizeof(mrrle_t));
+	memset(oc, 0, 48);
+	w.r = &out, w.c = 0, w.l = 0;
+	r.p = rl->s, r.c = 0, r.l = 0;
+	for (beg = 0; beg < m; beg = k) {
+		int64_t i, x, l = a[beg].l, u = a[beg].u, tl[6], tu[6], c[6];
+		int j, b;
+		for (k = beg + 1; k < m && a[k].u == a[beg].u; ++k);
+		rd_copy(&r, end, l - pos, &w, oc); // $oc is now the rank at $l in the current coordinates
+		pos = l;
+		if (l == u) {
+			memset(tl, 0, 48);
+			memset(tu, 0, 48);
+		} else {
+			mrrd_t t = r;
+			memcpy(tl, oc, 48);
+			memcpy(tu, oc, 48);
+			rd_count(&t, u - l, tu); // the old symbols in [l,u) are all ahead of $r
+		}
+		memset(c, 0, 48);
+		for (i = beg; i < k; ++i) c[a[i].c] += tr_mul(&a[i], mu);
+		if (c[0]) wr_run(&w, 0, c[0]), oc[0] += c[0], pos += c[0];
+		x = l + c[0] + (tu[0] - tl[0]);
+		for (j = 1; j < 6; ++j) {
+			b = mr_order[is_comp][j];
+			if (c[b]) {
+				int64_t z;
+				rd_copy(&r, end, x - pos, &w, oc);
+				z = oc[b];
+				wr_run(&w, b, c[b]);
+				oc[b] += c[b], pos = x + c[b];
+				tu[b] += z - tl[b], tl[b] = z;
+			}
+			x += c[b] + (tu[b] - tl[b]);
+		}
+		for (i = beg; i < k; ++i) {
+			triple64_t *p = &a[i];
+			p->l = tl[p->c], p->u = tu[p->c];
+		}
+	}
+	rd_copy(&r, end, -1, &w, oc);
+	wr_flush(&w);
+	free(rl->s);
+	*rl = out;
+}
+
+static void mr_bcr_load(mrope_t *mr, mrrle_t *bk) // replace the empty ropes with the streams
+{
+	int a;
+	for (a = 0; a < 6; ++a) {
+		const uint8_t *q = bk[a].s, *end = bk[a].s + bk[a].n;
+		rpbuild_t *rb;
+		rb = rope_build_init(mr->r[a], 1.);
+		while (q < end) {
+			int c = 0;
+			int64_t l;
+			rle_dec1(q, c, l);
+			rope_build_run(rb, c, l);
+		}
+		rope_build_finish(rb, mr->r[a]);
+		free(bk[a].s);
+	}
+}
+
+/*******************
+ *** Thread pool ***
+ *******************/
+
+typedef struct mrpool_s mrpool_t;
+typedef void (*mrjob_f)(void *data, int tid);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define mr_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define mr_cpu_relax() __asm__ __volatile__("yield")
+#else
+#define mr_cpu_relax() ((void)0)
+#endif
+
+#define MR_BARRIER_SPIN 4096 // spin this many times before blocking on the condition variable
+
+typedef struct { // generation-counting barrier: spin for a short while, then sleep
+	int n, spin, n_sleepers;
+	volatile int n_arrived;
+	volatile unsigned gen;
+	int64_t n_sleeps;
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+} mrbarrier_t;
+
+static void mr_barrier_init(mrbarrier_t *b, int n)
+{
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	memset(b, 0, sizeof(mrbarrier_t));
+	b->n = n;
+	b->spin = n_cpus >= n? MR_BARRIER_SPIN : 0; // spinning on an oversubscribed machine only delays the thread we wait for
+	pthread_mutex_init(&b->mtx, 0);
+	pthread_cond_init(&b->cv, 0);
+}
+
+static void mr_barrier_destroy(mrbarrier_t *b)
+{
+	pthread_mutex_destroy(&b->mtx);
+	pthread_cond_destroy(&b->cv);
+}
+
+static int mr_barrier_wait(mrbarrier_t *b) // return 1 for the last thread arriving at the barrier
+{
+	unsigned gen = b->gen;
+	int i;
+	if (__sync_add_and_fetch(&b->n_arrived, 1) == b->n) {
+		b->n_arrived = 0;
+		pthread_mutex_lock(&b->mtx);
+		__sync_add_and_fetch(&b->gen, 1);
+		if (b->n_sleepers) pthread_cond_broadcast(&b->cv);
+		pthread_mutex_unlock(&b->mtx);
+		return 1;
+	}
+	for (i = 0; i < b->spin && __atomic_load_n(&b->gen, __ATOMIC_ACQUIRE) == gen; ++i) mr_cpu_relax(); // acquire: see what others wrote before arriving
+	if (__atomic_load_n(&b->gen, __ATOMIC_ACQUIRE) == gen) {
+		pthread_mutex_lock(&b->mtx);
+		++b->n_sleepers, ++b->n_sleeps;
+		while (b->gen == gen) pthread_cond_wait(&b->cv, &b->mtx);
+		--b->n_sleepers;
+		pthread_mutex_unlock(&b->mtx);
+	}
+	return 0;
+}
+
+static double mr_realtime(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+typedef struct {
+	mrpool_t *p;
+	int tid;
+	double t_busy;
+} mrworker_t;
+
+struct mrpool_s {
+	int n_threads, to_exit;
+	mrjob_f func;
+	void *data;
+	mrbarrier_t start, end;
+	pthread_t *tid;
+	mrworker_t *w;
+};
+
+static void *mr_worker(void *data)
+{
+	mrworker_t *w = (mrworker_t*)data;
+	mrpool_t *p = w->p;
+	for (;;) {
+		double t;
+		mr_barrier_wait(&p->start); // wait for the signal from the master thread
+		if (p->to_exit) break;
+		t = mr_realtime();
+		p->func(p->data, w->tid);
+		w->t_busy += mr_realtime() - t;
+		mr_barrier_wait(&p->end);
+	}
 	return 0;
 }
 
-void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int is_thr)
+static mrpool_t *mr_pool_init(int n_threads) // the master thread is counted in $n_threads
+{
+	mrpool_t *p;
+	int i;
+	p = calloc(1, sizeof(mrpool_t));
+	p->n_threads = n_threads;
+	mr_barrier_init(&p->start, n_threads);
+	mr_barrier_init(&p->end, n_threads);
+	p->tid = calloc(n_threads, sizeof(pthread_t));
+	p->w = calloc(n_threads, sizeof(mrworker_t));
+	for (i = 1; i < n_threads; ++i) {
+		p->w[i].p = p, p->w[i].tid = i;
+		pthread_create(&p->tid[i], 0, mr_worker, &p->w[i]);
+	}
+	return p;
+}
+
+static void mr_pool_run(mrpool_t *p, mrjob_f func, void *data, mrstat_t *st) // run $func on all threads and wait until they finish
+{
+	double t0, t1;
+	t0 = mr_realtime();
+	p->func = func, p->data = data;
+	mr_barrier_wait(&p->start);
+	func(data, 0); // the master thread takes a share, too
+	t1 = mr_realtime();
+	p->w[0].t_busy += t1 - t0;
+	mr_barrier_wait(&p->end);
+	if (st) {
+		double t2 = mr_realtime();
+		++st->n_par_rounds;
+		st->t_par += t2 - t0, st->t_idle += t2 - t1;
+		if (t2 - t0 > st->t_max_round) st->t_max_round = t2 - t0;
+	}
+}
+
+static void mr_pool_destroy(mrpool_t *p, mrstat_t *st)
+{
+	int i;
+	if (p == 0) return;
+	p->to_exit = 1;
+	mr_barrier_wait(&p->start);
+	for (i = 1; i < p->n_threads; ++i) pthread_join(p->tid[i], 0);
+	if (st) {
+		st->n_sleeps += p->start.n_sleeps + p->end.n_sleeps;
+		for (i = 0; i < p->n_threads; ++i)
+			st->t_busy[i < MR_STAT_MAX_THR? i : MR_STAT_MAX_THR - 1] += p->w[i].t_busy;
+		if (st->n_threads < p->n_threads) st->n_threads = p->n_threads < MR_STAT_MAX_THR? p->n_threads : MR_STAT_MAX_THR;
+	}
+	mr_barrier_destroy(&p->start); mr_barrier_destroy(&p->end);
+	free(p->tid); free(p->w); free(p);
+}
+
+typedef struct { // insert different buckets in parallel
+	mrope_t *mr;
+	mrrle_t *bk;
+	const uint8_t *s;
+	int pk, mu, is_comp, n_tasks, task[5], n_threads;
+	volatile int i_task;
+	int64_t c[6];
+	triple64_t **q;
+} mrjob_ins_t;
+
+static void mr_insert_bucket(mrope_t *mr, mrrle_t *bk, int b, int64_t n, triple64_t *q, const uint8_t *s, int pk, int mu, int is_comp)
+{
+	double t = mr_realtime();
+	if (bk) mr_bcr_aux(&bk[b], n, q, s, pk, mu, is_comp);
+	else mr_insert_multi_aux(mr->r[b], n, q, s, pk, mu, is_comp);
+	mr->st.t_bucket[b] += mr_realtime() - t; // each bucket is inserted by one thread at a time
+}
+
+static void job_insert(void *data, int tid)
+{
+	mrjob_ins_t *j = (mrjob_ins_t*)data;
+	int i;
+	if (j->n_threads >= 5) { // one thread per bucket: bucket $b always goes to thread $b-1, which then first-touches the rope's memory
+		if (tid < 5 && j->c[tid+1]) mr_insert_bucket(j->mr, j->bk, tid+1, j->c[tid+1], j->q[tid+1], j->s, j->pk, j->mu, j->is_comp);
+		return;
+	}
+	while ((i = __sync_fetch_and_add(&j->i_task, 1)) < j->n_tasks) { // whoever is free takes the next largest bucket
+		int b = j->task[i];
+		mr_insert_bucket(j->mr, j->bk, b, j->c[b], j->q[b], j->s, j->pk, j->mu, j->is_comp);
+	}
+}
+
+#define MR_PAR_PART_MIN 0x10000 // partition a round on the thread pool when there are this many strings left
+#define MR_WC_SIZE      8       // write-combining buffer size per bucket, in triples
+
+typedef struct { // counting sort of prev[beg,end) into curr, in parallel
+	int n_threads;
+	int64_t beg, end;
+	const triple64_t *src;
+	triple64_t *dst;
+	int64_t (*cnt)[6]; // per-thread histograms; turned into per-thread offsets in $dst after prefix sum
+} mrjob_part_t;
+
+static inline void mr_chunk(int64_t beg, int64_t end, int n, int i, int64_t *st, int64_t *en)
+{
+	*st = beg + (end - beg) * i / n;
+	*en = beg + (end - beg) * (i + 1) / n;
+}
+
+static void job_count(void *data, int tid)
+{
+	mrjob_part_t *j = (mrjob_part_t*)data;
+	int64_t k, st, en, *cnt = j->cnt[tid];
+	mr_chunk(j->beg, j->end, j->n_threads, tid, &st, &en);
+	memset(cnt, 0, 48);
+	for (k = st; k < en; ++k) ++cnt[j->src[k].c];
+}
+
+static void job_scatter(void *data, int tid)
+{
+	mrjob_part_t *j = (mrjob_part_t*)data;
+	triple64_t buf[6][MR_WC_SIZE];
+	int64_t k, st, en, *off = j->cnt[tid];
+	int b, n[6];
+	mr_chunk(j->beg, j->end, j->n_threads, tid, &st, &en);
+	memset(n, 0, sizeof(int) * 6);
+	for (k = st; k < en; ++k) { // stage triples in small per-bucket buffers to write full cache lines
+		b = j->src[k].c;
+		buf[b][n[b]++] = j->src[k];
+		if (n[b] == MR_WC_SIZE) {
+			memcpy(&j->dst[off[b]], buf[b], MR_WC_SIZE * sizeof(triple64_t));
+			off[b] += MR_WC_SIZE, n[b] = 0;
+		}
+	}
+	for (b = 0; b < 6; ++b)
+		if (n[b]) memcpy(&j->dst[off[b]], buf[b], n[b] * sizeof(triple64_t));
+}
+
+typedef struct { // add the counts of preceding buckets to the intervals, in parallel
+	int n_threads;
+	int64_t c[6], ac[6][6];
+	triple64_t **q;
+} mrjob_upd_t;
+
+static void job_update(void *data, int tid)
+{
+	mrjob_upd_t *j = (mrjob_upd_t*)data;
+	int64_t k, st, en, beg = 0, end = 0;
+	int b;
+	for (b = 1; b < 6; ++b) end += j->c[b];
+	mr_chunk(beg, end, j->n_threads, tid, &st, &en);
+	for (b = 1; b < 6; ++b) { // buckets 1..5 are contiguous; $beg is the start of bucket $b
+		int64_t s0 = st > beg? st : beg, e0 = en < beg + j->c[b]? en : beg + j->c[b];
+		const int64_t *ac = j->ac[b];
+		for (k = s0; k < e0; ++k) {
+			triple64_t *p = &j->q[b][k - beg];
+			p->l += ac[p->c]; p->u += ac[p->c];
+		}
+		beg += j->c[b];
+	}
+}
+
+#define mr_bucket_c(mr, bk, b) ((bk)? (bk)[b].c : (mr)->r[b]->c) // symbol counts of bucket $b, on flat arrays or not
+
+static int64_t mr_count_str(int64_t len, const uint8_t *s, int pk) // number of sentinels
+{
+	int64_t k, m = 0;
+	if (pk) {
+		for (k = 0; k < len>>1; ++k)
+			m += (s[k] & 0xf) == 0, m += (s[k] >> 4) == 0;
+		if (len&1) m += (s[k] & 0xf) == 0;
+	} else {
+		for (k = 0; k < len; ++k)
+			if (s[k] == 0) ++m;
+	}
+	return m;
+}
+
+static void mr_insert_multi_core(mrope_t *mr, int64_t len, const uint8_t *s, int pk, const uint32_t *cnt, int n_threads)
 {
-	int64_t k, m, n0;
-	int b, is_srt = (mr->so != MR_SO_IO), is_comp = (mr->so == MR_SO_RCLO), stop_thr = 0;
-	volatile int n_fin_workers = 0;
+	int64_t k, m, n0, n_str;
+	int b, is_srt = (mr->so != MR_SO_IO), is_comp = (mr->so == MR_SO_RCLO), stop_thr = 0, mu = (cnt && is_srt);
 	triple64_t *a[2], *curr, *prev, *swap;
-	pthread_t *tid = 0;
-	worker_t *w = 0;
+	mrpool_t *pool = 0;
+	mrrle_t *bk = 0;
 
 	if (mr->thr_min < 0) mr->thr_min = 0;
-	assert(len > 0 && s[len-1] == 0);
-	{ // split into short strings
+	assert(len > 0 && mr_sym(s, len-1, pk) == 0);
+	m = n_str = mr_count_str(len, s, pk); // split into short strings
+	if (cnt) // one triple per MR_MUL_MAX copies in RLO/RCLO, or per copy in IO
+		for (k = 0, m = 0; k < n_str; ++k)
+			m += mu? (cnt[k] + MR_MUL_MAX - 1) / MR_MUL_MAX : cnt[k];
+	curr = a[0] = malloc(m * sizeof(triple64_t));
+	prev = a[1] = malloc(m * sizeof(triple64_t));
+	if (cnt) {
+		int64_t p, q, i;
+		for (p = q = i = k = 0; p != len; ++p) // find the start of each string and spread its copies
+			if (mr_sym(s, p, pk) == 0) {
+				int64_t r, x;
+				for (r = cnt[i++]; r > 0; r -= x, ++k) {
+					x = mu? (r < MR_MUL_MAX? r : MR_MUL_MAX) : 1;
+					tr_set_p(&prev[k], mu? (x - 1) << MR_MUL_SHIFT | q : q);
+				}
+				q = p + 1;
+			}
+	} else if (pk) {
+		int64_t p, q;
+		for (p = q = k = 0; p != len; ++p) // find the start of each string
+			if (mr_sym(s, p, 1) == 0) tr_set_p(&prev[k], q), ++k, q = p + 1;
+	} else {
 		cstr_t p, q, end = s + len;
-		for (p = s, m = 0; p != end; ++p) // count #sentinels
-			if (*p == 0) ++m;
-		curr = a[0] = malloc(m * sizeof(triple64_t));
-		prev = a[1] = malloc(m * sizeof(triple64_t));
-		for (p = q = s, k = 0; p != end; ++p) // find the start of each string
-			if (*p == 0) prev[k++].p = q, q = p + 1;
+		for (p = q = s, k = 0; p != end; ++p)
+			if (*p == 0) tr_set_p(&prev[k], q - s), ++k, q = p + 1;
 	}
 
+	if (mr->bcr_max_len > 0 && mr->mm == 0 && mr_get_tot(mr) == 0 && len - n_str <= (int64_t)mr->bcr_max_len * n_str)
+		bk = calloc(6, sizeof(mrrle_t));
 	for (k = n0 = 0; k < 6; ++k) n0 += mr->r[k]->c[0];
 	for (k = 0; k != m; ++k) {
 		if (is_srt) prev[k].l = 0, prev[k].u = n0;
 		else prev[k].l = prev[k].u = n0 + k;
 		prev[k].c = 0;
 	}
-	mr_insert_multi_aux(mr->r[0], m, prev, is_comp); // insert the first (actually the last) column
+	mr_insert_bucket(mr, bk, 0, m, prev, s, pk, mu, is_comp); // insert the first (actually the last) column
 
-	if (is_thr) {
-		tid = alloca(4 * sizeof(pthread_t));
-		w = alloca(4 * sizeof(worker_t));
-		memset(w, 0, 4 * sizeof(worker_t));
-		for (b = 0; b < 4; ++b) {
-			w[b].mr = mr, w[b].b = b + 1, w[b].is_comp = is_comp;
-			w[b].n_fin_workers = &n_fin_workers;
-		}
-		for (b = 0; b < 4; ++b) pthread_create(&tid[b], 0, worker, &w[b]);
-	}
+	if (n_threads > 1) pool = mr_pool_init(n_threads);
 
 	n0 = 0; // the number of inserted strings
 	while (m) {
 		int64_t c[6], ac[6];
 		triple64_t *q[6];
+		double t0, t1, t2;
 
+		t0 = mr_realtime();
 		memset(c, 0, 48);
-		for (k = n0; k != m; ++k) ++c[prev[k].c]; // counting
-		for (q[0] = curr + n0, b = 1; b < 6; ++b) q[b] = q[b-1] + c[b-1];
-		if (n0 + c[0] < m) {
-			for (k = n0; k != m; ++k) *q[prev[k].c]++ = prev[k]; // sort
-			for (b = 0; b < 6; ++b) q[b] -= c[b];
+		if (pool && m - n0 >= MR_PAR_PART_MIN) { // per-thread histograms, prefix sum and parallel scatter
+			mrjob_part_t j;
+			int t;
+			j.n_threads = pool->n_threads, j.beg = n0, j.end = m, j.src = prev, j.dst = curr;
+			j.cnt = calloc(pool->n_threads, sizeof(*j.cnt));
+			mr_pool_run(pool, job_count, &j, 0);
+			for (t = 0; t < pool->n_threads; ++t)
+				for (b = 0; b < 6; ++b) c[b] += j.cnt[t][b];
+			for (q[0] = curr + n0, b = 1; b < 6; ++b) q[b] = q[b-1] + c[b-1];
+			if (n0 + c[0] < m) {
+				for (b = 0; b < 6; ++b) {
+					int64_t off = q[b] - curr;
+					for (t = 0; t < pool->n_threads; ++t) {
+						int64_t tmp = j.cnt[t][b];
+						j.cnt[t][b] = off, off += tmp;
+					}
+				}
+				mr_pool_run(pool, job_scatter, &j, 0);
+			}
+			free(j.cnt);
+		} else {
+			for (k = n0; k != m; ++k) ++c[prev[k].c]; // counting
+			for (q[0] = curr + n0, b = 1; b < 6; ++b) q[b] = q[b-1] + c[b-1];
+			if (n0 + c[0] < m) {
+				for (k = n0; k != m; ++k) *q[prev[k].c]++ = prev[k]; // sort
+				for (b = 0; b < 6; ++b) q[b] -= c[b];
+			}
 		}
 		n0 += c[0];
+		++mr->st.n_rounds;
+		t1 = mr_realtime();
+		mr->st.t_sort += t1 - t0;
 
-		if (is_thr && !stop_thr) {
-			struct timespec req, rem;
-			req.tv_sec = 0; req.tv_nsec = 1000000;
+		if (pool && !stop_thr) {
+			mrjob_ins_t j;
+			int i;
 			stop_thr = (m - n0 <= mr->thr_min);
-			for (b = 0; b < 4; ++b) {
-				w[b].a = q[b+1], w[b].m = c[b+1];
-				if (stop_thr) w[b].to_exit = 1; // signal the workers to exit
-				while (!__sync_bool_compare_and_swap(&w[b].to_run, 0, 1)); // signal the workers to start
+			memset(&j, 0, sizeof(mrjob_ins_t));
+			j.mr = mr, j.bk = bk, j.s = s, j.pk = pk, j.mu = mu, j.is_comp = is_comp, j.q = q, j.n_threads = pool->n_threads;
+			memcpy(j.c, c, 48);
+			for (b = 1; b < 6; ++b) // collect non-empty buckets in the descending order of size
+				if (c[b]) {
+					for (i = j.n_tasks++; i > 0 && c[j.task[i-1]] < c[b]; --i)
+						j.task[i] = j.task[i-1];
+					j.task[i] = b;
+				}
+			if (j.n_tasks > 1) mr_pool_run(pool, job_insert, &j, &mr->st);
+			else j.n_threads = 1, job_insert(&j, 0);
+			if (stop_thr) {
+				mr_pool_destroy(pool, &mr->st);
+				pool = 0;
+				if (n0 < m) fprintf(stderr, "[M::%s] Turn off parallelization for this batch as too few strings are left.\n", __func__);
 			}
-			if (c[5]) mr_insert_multi_aux(mr->r[5], c[5], q[5], is_comp); // the master thread processes the "N" bucket
-			while (!__sync_bool_compare_and_swap(&n_fin_workers, 4, 0)) // wait until all 4 workers finish
-				nanosleep(&req, &rem);
-			if (stop_thr && n0 < m)
-				fprintf(stderr, "[M::%s] Turn off parallelization for this batch as too few strings are left.\n", __func__);
 		} else {
 			for (b = 1; b < 6; ++b)
-				if (c[b]) mr_insert_multi_aux(mr->r[b], c[b], q[b], is_comp);
+				if (c[b]) mr_insert_bucket(mr, bk, b, c[b], q[b], s, pk, mu, is_comp);
 		}
+		t2 = mr_realtime();
+		mr->st.t_ins += t2 - t1;
 		if (n0 == m) break;
 
-		memset(ac, 0, 48);
-		for (b = 1; b < 6; ++b) { // update the intervals to account for buckets ahead
+		if (pool && m - n0 >= MR_PAR_PART_MIN) {
+			mrjob_upd_t j;
 			int a;
-			for (a = 0; a < 6; ++a) ac[a] += mr->r[b-1]->c[a];
-			for (k = 0; k < c[b]; ++k) {
-				triple64_t *p = &q[b][k];
-				p->l += ac[p->c]; p->u += ac[p->c];
+			j.n_threads = pool->n_threads, j.q = q;
+			memcpy(j.c, c, 48);
+			memset(ac, 0, 48);
+			for (b = 1; b < 6; ++b) {
+				for (a = 0; a < 6; ++a) ac[a] += mr_bucket_c(mr, bk, b-1)[a];
+				memcpy(j.ac[b], ac, 48);
+			}
+			mr_pool_run(pool, job_update, &j, 0);
+		} else {
+			memset(ac, 0, 48);
+			for (b = 1; b < 6; ++b) { // update the intervals to account for buckets ahead
+				int a;
+				for (a = 0; a < 6; ++a) ac[a] += mr_bucket_c(mr, bk, b-1)[a];
+				for (k = 0; k < c[b]; ++k) {
+					triple64_t *p = &q[b][k];
+					p->l += ac[p->c]; p->u += ac[p->c];
+				}
 			}
 		}
+		mr->st.t_upd += mr_realtime() - t2;
 		swap = curr, curr = prev, prev = swap;
 	}
-	if (is_thr) for (b = 0; b < 4; ++b) pthread_join(tid[b], 0);
+	mr_pool_destroy(pool, &mr->st);
 	free(a[0]); free(a[1]);
+	if (bk) {
+		mr_bcr_load(mr, bk);
+		free(bk);
+	}
+}
+
+#define MR_BCR_FRESH 4 // build a batch this many times larger than the index on its own, then merge
+
+static void mr_insert_multi_pk(mrope_t *mr, int64_t len, const uint8_t *s, int pk, const uint32_t *cnt, int n_threads)
+{
+	int64_t c[6], tot, max_len = 1LL<<(cnt? MR_MUL_SHIFT : MR_OFF_BITS);
+	assert(len > 0 && mr_sym(s, len-1, pk) == 0);
+	tot = mr_get_c(mr, c);
+	if (tot > 0 && mr->bcr_max_len > 0 && mr->mm == 0 && len >= MR_BCR_FRESH * tot) {
+		int64_t m = mr_count_str(len, s, pk);
+		if (len - m <= (int64_t)mr->bcr_max_len * m) { // short strings: use flat arrays on an empty index and merge it into $mr
+			mrope_t *t;
+			t = mr_init(mr->r[0]->max_nodes, mr->r[0]->block_len, mr->so);
+			t->thr_min = mr->thr_min, t->bcr_max_len = mr->bcr_max_len, t->st = mr->st;
+			mr_insert_multi_pk(t, len, s, pk, cnt, n_threads);
+			mr->st = t->st;
+			mr_merge(mr, t, 1., n_threads);
+			mr_destroy(t);
+			return;
+		}
+	}
+	if (tot + len >= 1LL<<MR_POS_BITS) { // intervals would not fit in triple64_t::l/u
+		int64_t p, q, i = 0, r;
+		uint8_t *str = 0;
+		fprintf(stderr, "[W::%s] the index is too large for batched insertion; inserting strings one by one\n", __func__);
+		if (!pk) {
+			for (p = 0; p < len; p += strlen((const char*)s + p) + 1)
+				for (r = cnt? cnt[i++] : 1; r > 0; --r)
+					mr_insert1(mr, s + p);
+			return;
+		}
+		for (p = q = 0; p < len; ++p) { // unpack each string
+			if (((p - q) & 0xff) == 0) str = realloc(str, p - q + 0x100);
+			if ((str[p - q] = mr_sym(s, p, 1)) == 0) {
+				for (r = cnt? cnt[i++] : 1; r > 0; --r)
+					mr_insert1(mr, str);
+				q = p + 1;
+			}
+		}
+		free(str);
+		return;
+	}
+	while (len >= max_len) { // offsets would not fit in triple64_t::ph/pl; cut the batch at a sentinel
+		int64_t l = max_len - 1;
+		while (mr_sym(s, l-1, pk) != 0 || (pk && (l&1))) --l; // a packed batch is cut at a byte boundary
+		mr_insert_multi_core(mr, l, s, pk, cnt, n_threads);
+		if (cnt) cnt += mr_count_str(l, s, pk);
+		s += pk? l>>1 : l, len -= l;
+	}
+	mr_insert_multi_core(mr, len, s, pk, cnt, n_threads);
+}
+
+void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int n_threads)
+{
+	mr_insert_multi_pk(mr, len, s, 0, 0, n_threads);
+}
+
+void mr_insert_multi4(mrope_t *mr, int64_t len, const uint8_t *s, int n_threads)
+{
+	mr_insert_multi_pk(mr, len, s, 1, 0, n_threads);
+}
+
+void mr_insert_multi_cnt(mrope_t *mr, int64_t len, const uint8_t *s, int is_packed, const uint32_t *cnt, int n_threads)
+{
+	mr_insert_multi_pk(mr, len, s, !!is_packed, cnt, n_threads);
+}
+
+/*******************************
+ *** Merging two multi-ropes ***
+ *******************************/
+
+#define MR_MRG_BUF 256 // number of queries passed to mr_rank2a_batch() together
+
+typedef struct { // a string of $b in the merge
+	int64_t a, b; // number of rows of $a before the current suffix, and the row of the suffix in $b
+} mrpos_t;
+
+typedef struct { // a string of $b being placed among the strings of $a in the sorting order
+	int64_t b, l, u; // the current row in $b, and rows [l,u) of $a with the same suffix
+	int64_t y, s; // strings in $a that come first, and the $-row of the string in $b
+} mrsrch_t;
+
+typedef struct {
+	mrope_t *a;
+	const mrope_t *b;
+	int n_threads, is_comp;
+	int64_t ac[7], bc[7]; // accumulative counts of $a and $b
+	int64_t n; // number of strings in the current round
+	mrpos_t *p;
+	mrsrch_t *q;
+	uint8_t *c; // the symbol preceding each string in the current round; 0 to drop the string
+	int64_t *y; // mrsrch_t::y for each $-row of $b
+	uint64_t *bits; // bit x is set if row x of the merged BWT comes from $b
+	double fill;
+	rope_t *r[6]; // merged ropes
+} mrjob_mrg_t;
+
+static inline int mr_c_at(const int64_t *cx, const int64_t *cy) // the symbol between two ranks one apart
+{
+	int a;
+	for (a = 0; a < 5 && cy[a] == cx[a]; ++a);
+	return a;
+}
+
+static void job_search(void *data, int tid) // one step of mr_insert1() without the insertion
+{
+	mrjob_mrg_t *j = (mrjob_mrg_t*)data;
+	int64_t i, k, t, st, en, xb[MR_MRG_BUF], yb[MR_MRG_BUF], l[MR_MRG_BUF], u[MR_MRG_BUF];
+	int64_t cx[MR_MRG_BUF*6], cy[MR_MRG_BUF*6], tl[MR_MRG_BUF*6], tu[MR_MRG_BUF*6];
+	mr_chunk(0, j->n, j->n_threads, tid, &st, &en);
+	for (i = st; i < en; i += k) {
+		k = en - i < MR_MRG_BUF? en - i : MR_MRG_BUF;
+		for (t = 0; t < k; ++t) {
+			mrsrch_t *q = &j->q[i+t];
+			xb[t] = q->b, yb[t] = q->b + 1, l[t] = q->l, u[t] = q->u;
+		}
+		mr_rank2a_batch(j->b, k, xb, yb, cx, cy);
+		mr_rank2a_batch(j->a, k, l, u, tl, tu);
+		for (t = 0; t < k; ++t) {
+			mrsrch_t *q = &j->q[i+t];
+			const int64_t *pl = &tl[t*6], *pu = &tu[t*6];
+			int a, c = mr_c_at(&cx[t*6], &cy[t*6]);
+			if (c) {
+				const uint8_t *ord = mr_order[j->is_comp];
+				for (a = 0; ord[a] != c; ++a) q->y += pu[ord[a]] - pl[ord[a]];
+				q->l = j->ac[c] + pl[c], q->u = j->ac[c] + pu[c];
+				q->b = j->bc[c] + cx[t*6+c];
+				if (q->l == q->u) c = 0; // no other string in $a shares the suffix
+			}
+			if (c == 0) j->y[q->s] = q->y;
+			j->c[i+t] = c;
+		}
+	}
+}
+
+static void job_mark(void *data, int tid) // mark the rows of the current suffixes and move to the preceding ones
+{
+	mrjob_mrg_t *j = (mrjob_mrg_t*)data;
+	int64_t i, k, t, st, en, xa[MR_MRG_BUF], xb[MR_MRG_BUF], yb[MR_MRG_BUF];
+	int64_t ca[MR_MRG_BUF*6], cx[MR_MRG_BUF*6], cy[MR_MRG_BUF*6];
+	mr_chunk(0, j->n, j->n_threads, tid, &st, &en);
+	for (i = st; i < en; i += k) {
+		k = en - i < MR_MRG_BUF? en - i : MR_MRG_BUF;
+		for (t = 0; t < k; ++t) {
+			mrpos_t *p = &j->p[i+t];
+			int64_t z = p->a + p->b;
+			__sync_fetch_and_or(&j->bits[z>>6], 1ULL<<(z&63));
+			xa[t] = p->a, xb[t] = p->b, yb[t] = p->b + 1;
+		}
+		mr_rank2a_batch(j->b, k, xb, yb, cx, cy);
+		mr_rank2a_batch(j->a, k, xa, 0, ca, 0);
+		for (t = 0; t < k; ++t) {
+			mrpos_t *p = &j->p[i+t];
+			int c = mr_c_at(&cx[t*6], &cy[t*6]);
+			if (c) p->a = j->ac[c] + ca[t*6+c], p->b = j->bc[c] + cx[t*6+c];
+			j->c[i+t] = c;
+		}
+	}
+}
+
+static int64_t mr_part(const void *src, void *dst, size_t size, const uint8_t *c, int64_t n) // stable sort by $c, dropping 0
+{
+	int64_t i, off[6];
+	int a;
+	memset(off, 0, 48);
+	for (i = 0; i < n; ++i) ++off[c[i]];
+	for (a = 1, off[0] = 0; a < 6; ++a) { // off[a]: start of bucket $a
+		int64_t tmp = off[a];
+		off[a] = off[0], off[0] += tmp;
+	}
+	for (i = 0; i < n; ++i)
+		if (c[i]) memcpy((uint8_t*)dst + off[c[i]]++ * size, (const uint8_t*)src + i * size, size);
+	return off[5];
+}
+
+static int mr_cmp64(const void *a, const void *b)
+{
+	return *(const int64_t*)a < *(const int64_t*)b? -1 : *(const int64_t*)a > *(const int64_t*)b;
+}
+
+static void job_interleave(void *data, int tid)
+{
+	mrjob_mrg_t *j = (mrjob_mrg_t*)data;
+	int a;
+	for (a = tid; a < 6; a += j->n_threads)
+		j->r[a] = rope_merge(j->a->r[a], j->b->r[a], j->bits, j->ac[a] + j->bc[a], j->fill);
+}
+
+int mr_merge(mrope_t *mr, const mrope_t *b, double fill, int n_threads)
+{
+	mrjob_mrg_t j;
+	mrpool_t *pool = 0;
+	int64_t tot, s, m;
+	void *tmp, *sw;
+	int a;
+
+	if (mr->so != b->so) return -1;
+	memset(&j, 0, sizeof(mrjob_mrg_t));
+	j.a = mr, j.b = b, j.fill = fill, j.is_comp = (mr->so == MR_SO_RCLO);
+	tot = mr_get_ac(mr, j.ac) + mr_get_ac(b, j.bc);
+	j.n_threads = n_threads > 1? n_threads : 1;
+	if (j.n_threads > 1) pool = mr_pool_init(j.n_threads);
+	m = j.bc[1]; // number of strings in $b
+	j.c = malloc(m);
+	j.y = malloc(m * 8);
+	if (mr->so != MR_SO_IO) { // find where the strings of $b go among those of $a, all strings at a time
+		j.q = malloc(m * sizeof(mrsrch_t));
+		tmp = malloc(m * sizeof(mrsrch_t));
+		for (s = 0; s < m; ++s) {
+			mrsrch_t *q = &j.q[s];
+			q->b = q->s = s, q->l = 0, q->u = j.ac[1], q->y = 0;
+			if (q->u == 0) j.y[s] = 0;
+		}
+		for (j.n = j.ac[1]? m : 0; j.n > 0;) {
+			if (pool) mr_pool_run(pool, job_search, &j, 0);
+			else job_search(&j, 0);
+			j.n = mr_part(j.q, tmp, sizeof(mrsrch_t), j.c, j.n);
+			sw = j.q, j.q = tmp, tmp = sw;
+		}
+		free(j.q); free(tmp);
+		qsort(j.y, m, 8, mr_cmp64); // $-rows with the same symbol can be swapped; ranks are assigned in order
+	} else for (s = 0; s < m; ++s) j.y[s] = j.ac[1]; // strings in $b come after all strings in $a
+	j.p = malloc(m * sizeof(mrpos_t));
+	tmp = malloc(m * sizeof(mrpos_t));
+	for (s = 0; s < m; ++s) j.p[s].a = j.y[s], j.p[s].b = s; // the strings are in the order of the merged BWT
+	free(j.y);
+	j.bits = calloc((tot + 63) / 64, 8);
+	for (j.n = m; j.n > 0;) { // backward search, keeping the strings in the order of their rows
+		if (pool) mr_pool_run(pool, job_mark, &j, 0);
+		else job_mark(&j, 0);
+		j.n = mr_part(j.p, tmp, sizeof(mrpos_t), j.c, j.n);
+		sw = j.p, j.p = tmp, tmp = sw;
+	}
+	free(j.p); free(tmp); free(j.c);
+	if (pool) {
+		mr_pool_run(pool, job_interleave, &j, 0);
+		mr_pool_destroy(pool, 0);
+	} else job_interleave(&j, 0);
+	free(j.bits);
+	for (a = 0; a < 6; ++a) {
+		rope_destroy(mr->r[a]);
+		mr->r[a] = j.r[a];
+	}
+	if (mr->mm) { // the old ropes were in the mapped file
+		munmap(mr->mm, mr->mm_size);
+		mr->mm = 0, mr->mm_size = 0;
+	}
+	return 0;
 }
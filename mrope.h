@@ -7,10 +7,29 @@
 #define MR_SO_RLO   1
 #define MR_SO_RCLO  2
 
+#define MR_STR_BYTES 32 // working memory of mr_insert_multi() per string
+#define MR_STAT_MAX_THR 64 // threads with separate busy times in mrstat_t; the rest are added to the last
+#define MR_BCR_MAX_LEN 64 // default of mr_bcr_max_len()
+
+typedef struct {
+	int64_t n_rounds, n_par_rounds; // number of BCR rounds, and those run on the thread pool
+	int64_t n_sleeps; // number of times a thread blocked at a barrier instead of spinning
+	double t_par, t_max_round; // wall-clock time spent in parallel rounds, and of the slowest round
+	double t_idle; // time the master thread waited for the workers after finishing its share
+	double t_sort, t_ins, t_upd; // wall-clock time in the three phases of a round: partition by symbol, insertion and interval update
+	double t_bucket[6]; // time spent inserting into each bucket, on whichever thread
+	int n_threads; // number of threads in $t_busy
+	double t_busy[MR_STAT_MAX_THR]; // time each thread spent running jobs on the thread pool; 0 is the master thread
+} mrstat_t;
+
 typedef struct {
 	uint8_t so; // sorting order
 	int thr_min; // when there are fewer sequences than this, disable multi-threading
+	int bcr_max_len; // build on flat arrays if strings in the batch are on average this long or shorter; see mr_bcr_max_len()
 	rope_t *r[6];
+	mrstat_t st; // accumulated over mr_insert_multi() calls
+	void *mm; // file mapped by mr_restore_mmap(), or NULL
+	int64_t mm_size;
 } mrope_t; // multi-rope
 
 typedef struct {
@@ -19,6 +38,40 @@ typedef struct {
 	rpitr_t i;
 } mritr_t;
 
+typedef struct {
+	int64_t x[3]; // x[0]: start of the interval; x[1]: start of its reverse complement; x[2]: size
+	int64_t info;
+} mrintv_t; // bi-interval, as rldintv_t in rld0.h
+
+#define MR_FRZ_RUN_BYTES 50 // bytes of runs in a block of a frozen index
+#define MR_FRZ_BLK_MAX   1023 // max symbols in a block
+#define MR_FRZ_MB_SHIFT  6 // blocks in a group are counted from its start in 16 bits
+#define MR_FRZ_SB_SHIFT  22 // groups in a superblock are counted from its start in 32 bits
+
+typedef struct {
+	uint16_t c[6], n; // counts of each symbol in the group before this block, and the number of symbols in it
+	uint8_t r[MR_FRZ_RUN_BYTES]; // runs in the 43+3 code of rle.h
+} mrfblk_t; // one cache line
+
+typedef struct {
+	uint8_t so; // sorting order
+	int shift; // position $x is in block smp[x>>shift] or a later one
+	int64_t tot, n_blk, n_mb, n_sb, n_smp; // numbers of symbols, blocks, groups, superblocks and samples
+	int64_t c[6]; // symbol counts
+	mrfblk_t *blk; // aligned to 64 bytes
+	uint32_t (*mc)[6]; // counts in the superblock before each group of 1<<MR_FRZ_MB_SHIFT blocks
+	int64_t (*sc)[6]; // counts before each superblock of 1<<MR_FRZ_SB_SHIFT blocks
+	uint32_t *smp;
+	void *mm; // file mapped by mr_frz_restore_mmap(), or NULL
+	int64_t mm_size;
+} mrfrz_t; // frozen multi-rope: the BWT in static blocks, for rank queries only
+
+struct mrsnap_s;
+typedef struct mrsnap_s mrsnap_t; // read-only copies of an index under construction
+
+struct mrbuild_s;
+typedef struct mrbuild_s mrbuild_t; // bulk loading from a BWT; see mr_build_init()
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -36,6 +89,48 @@ extern "C" {
 
 	int mr_thr_min(mrope_t *r, int thr_min);
 
+	/**
+	 * Set the longest mean string length for building an empty index on flat arrays
+	 *
+	 * When mr_insert_multi() is called on an empty index, each bucket is kept
+	 * as one array of runs, rewritten in order in every round, and turned
+	 * into a rope at the end. A round then takes time proportional to the
+	 * size of the bucket instead of the number of strings, so this is faster
+	 * only for short strings. A batch at least four times as large as a
+	 * non-empty index is built this way on its own and merged with
+	 * mr_merge(); other batches are inserted into the ropes.
+	 *
+	 * @param r        multi-rope
+	 * @param max_len  0 to disable; negative to only return the current value
+	 *
+	 * @return the current value
+	 */
+	int mr_bcr_max_len(mrope_t *r, int max_len);
+
+	/**
+	 * Set how the six ropes allocate memory from now on; see rope_mem_mode()
+	 *
+	 * With five or more threads, mr_insert_multi() always inserts a bucket
+	 * on the same thread, so with lazily populated pages, each rope lives on
+	 * the NUMA node its thread runs on.
+	 */
+	void mr_mem_mode(mrope_t *r, int mode);
+
+	/**
+	 * Repack all ropes one after another with rope_compact()
+	 *
+	 * @return  the number of bytes freed; negative if $fill is lower than the existing packing
+	 */
+	int64_t mr_compact(mrope_t *r, double fill);
+
+	/**
+	 * Copy the index, packed as by mr_compact()
+	 *
+	 * The copy takes memory and time proportional to the size of the index.
+	 * $mr must not be modified while it is copied.
+	 */
+	mrope_t *mr_dup(const mrope_t *mr, double fill);
+
 	/**
 	 * Insert one string into the index
 	 *
@@ -47,16 +142,125 @@ extern "C" {
 	/**
 	 * Insert multiple strings
 	 *
-	 * @param mr       multi-rope
-	 * @param len      total length of $s
-	 * @param s        concatenated, NULL delimited, reversed input strings
-	 * @param is_thr   true to use 5 threads
+	 * @param mr         multi-rope
+	 * @param len        total length of $s
+	 * @param s          concatenated, NULL delimited, reversed input strings
+	 * @param n_threads  number of threads; at most five buckets are inserted in parallel
+	 */
+	void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int n_threads);
+
+	/**
+	 * Insert multiple strings packed in 4 bits per symbol
+	 *
+	 * The same as mr_insert_multi(), except that symbol $i of the batch is in
+	 * the low 4 bits of s[i/2] if $i is even, or in the high 4 bits if odd.
+	 * This halves the batch; reading a symbol costs a shift and a mask.
+	 *
+	 * @param len        number of symbols in $s, including the sentinels
 	 */
-	void mr_insert_multi(mrope_t *mr, int64_t len, const uint8_t *s, int is_thr);
+	void mr_insert_multi4(mrope_t *mr, int64_t len, const uint8_t *s, int n_threads);
+
+	/**
+	 * Insert multiple strings, each with a number of identical copies
+	 *
+	 * The same as mr_insert_multi() or mr_insert_multi4() on a batch in
+	 * which the i-th string is repeated $cnt[i] times. In RLO and RCLO, the
+	 * copies of a string always share an interval, so they are carried by
+	 * one entry and inserted as runs; each round thus costs one step per
+	 * distinct string. In MR_SO_IO, copies are inserted one after another.
+	 *
+	 * @param is_packed  whether $s is packed as for mr_insert_multi4()
+	 * @param cnt        number of copies of each string, in the order of $s; at least 1
+	 */
+	void mr_insert_multi_cnt(mrope_t *mr, int64_t len, const uint8_t *s, int is_packed, const uint32_t *cnt, int n_threads);
+
+	/**
+	 * Merge another index into $mr without re-inserting its strings
+	 *
+	 * For each string in $b, the rows of its suffixes in $mr are found by
+	 * backward search; they give the interleaving of the two BWTs, and each
+	 * bucket is then rebuilt by reading the old ropes once, in order. All
+	 * strings move back one symbol per round and are kept in the order of
+	 * their rows, so both indices are queried with sorted batches. With
+	 * MR_SO_IO, strings in $b come after those in $mr, as if they were added
+	 * by mr_insert_multi(). Rounds are split across $n_threads threads and
+	 * buckets are rebuilt in parallel. Peak memory is that of both indices
+	 * and the merged index, plus one bit per symbol and 32 bytes per string
+	 * in $b.
+	 *
+	 * @param mr         multi-rope, replaced by the merged index
+	 * @param b          multi-rope to merge; not changed
+	 * @param fill       fill factor of the merged ropes, as in rope_compact()
+	 * @param n_threads  number of threads
+	 *
+	 * @return 0 on success; -1 if the two indices are in different sorting orders
+	 */
+	int mr_merge(mrope_t *mr, const mrope_t *b, double fill, int n_threads);
 
 	void mr_rank2a(const mrope_t *mr, int64_t x, int64_t y, int64_t *cx, int64_t *cy);
 	#define mr_rank1a(mr, x, cx) mr_rank2a(mr, x, -1, cx, 0)
 
+	/**
+	 * Compute mr_rank2a() for multiple intervals
+	 *
+	 * Consecutive queries in the same bucket share the path in the B+-tree,
+	 * so sort the queries by $x for the best performance.
+	 *
+	 * @param mr      multi-rope
+	 * @param n       number of queries
+	 * @param x       start of each interval
+	 * @param y       end of each interval; NULL or negative for rank of $x only
+	 * @param cx      (out) rank of each symbol a at x[i], at cx[i*6+a]
+	 * @param cy      (out) rank at y[i], at cy[i*6+a]
+	 */
+	void mr_rank2a_batch(const mrope_t *mr, int64_t n, const int64_t *x, const int64_t *y, int64_t *cx, int64_t *cy);
+
+	/**
+	 * Extend a bi-interval by one symbol, as rld_extend() does
+	 *
+	 * This requires both strands of each string in the index. Use
+	 * mr_set_intv() for the interval of a single symbol.
+	 *
+	 * @param mr       multi-rope
+	 * @param ik       bi-interval to extend
+	 * @param ok       (out) the bi-interval of each symbol at the end (or start with $is_back) of $ik
+	 * @param is_back  extend backward if true, or forward otherwise
+	 */
+	void mr_extend(const mrope_t *mr, const mrintv_t *ik, mrintv_t ok[6], int is_back);
+
+	/**
+	 * Create an empty set of snapshots
+	 *
+	 * The thread building an index calls mr_snap_publish() between batches
+	 * to make a copy of the index; threads querying the index call
+	 * mr_snap_acquire() to get the latest copy and mr_snap_release() when
+	 * done. Queries run on the copy without locks while the next batch is
+	 * inserted. A copy is freed once it has been replaced and released by
+	 * all readers, so readers holding older copies cost memory.
+	 */
+	mrsnap_t *mr_snap_init(void);
+
+	/**
+	 * Free a set of snapshots; all copies must have been released
+	 */
+	void mr_snap_destroy(mrsnap_t *s);
+
+	/**
+	 * Make a copy of $mr with mr_dup() and let it replace the latest snapshot
+	 *
+	 * $mr must not be modified during the call, e.g. by mr_insert_multi() on
+	 * another thread.
+	 */
+	void mr_snap_publish(mrsnap_t *s, const mrope_t *mr, double fill);
+
+	/**
+	 * Get the latest snapshot, which stays valid until mr_snap_release()
+	 *
+	 * @return the snapshot, or NULL if none has been published
+	 */
+	const mrope_t *mr_snap_acquire(mrsnap_t *s);
+	void mr_snap_release(mrsnap_t *s, const mrope_t *mr);
+
 	/**
 	 * Put the iterator at the start of the index
 	 *
@@ -75,9 +279,83 @@ extern "C" {
 	 */
 	const uint8_t *mr_itr_next_block(mritr_t *i);
 
+	/**
+	 * Convert the index to a static structure for rank queries
+	 *
+	 * The concatenated BWT of the six ropes is cut into cache-line blocks of
+	 * runs. Each block starts with the counts before it within its group of
+	 * 64 blocks, and a sample per few positions points to the block
+	 * containing it, so a rank query reads one or two adjacent blocks plus
+	 * the sample and the counts of the group and the superblock. There is no
+	 * B+-tree slack: the index takes about 64 bytes per 50 bytes of runs.
+	 * $mr is not changed.
+	 */
+	mrfrz_t *mr_freeze(mrope_t *mr);
+	void mr_frz_destroy(mrfrz_t *f);
+	void mr_frz_rank2a(const mrfrz_t *f, int64_t x, int64_t y, int64_t *cx, int64_t *cy); // as mr_rank2a()
+	void mr_frz_extend(const mrfrz_t *f, const mrintv_t *ik, mrintv_t ok[6], int is_back); // as mr_extend()
+
+	/**
+	 * Write a frozen index in a format that mr_frz_restore_mmap() maps as is
+	 *
+	 * @return 0 on success; -1 on write errors
+	 */
+	int mr_frz_dump(const mrfrz_t *f, FILE *fp);
+
+	/**
+	 * Map a file written by mr_frz_dump() read-only
+	 *
+	 * Pages are shared with other processes mapping the same file.
+	 *
+	 * @return the frozen index, or NULL if $fn cannot be mapped or is not in this format
+	 */
+	mrfrz_t *mr_frz_restore_mmap(const char *fn);
+
+	/**
+	 * Start loading a whole BWT into $mr, replacing its content
+	 *
+	 * The BWT is given in order with mr_build_run(). It is cut into the six
+	 * buckets by the symbol counts $c, and each rope is built bottom-up and
+	 * packed as by mr_compact(). The ropes keep their shape and memory mode;
+	 * $mr must not be mapped by mr_restore_mmap(). The sorting order is not
+	 * checked: $mr->so must be the order the BWT was built in.
+	 *
+	 * @param mr      multi-rope
+	 * @param c       number of each symbol in the BWT
+	 * @param fill    fill factor as in mr_compact()
+	 */
+	mrbuild_t *mr_build_init(mrope_t *mr, const int64_t c[6], double fill);
+	void mr_build_run(mrbuild_t *b, int c, int64_t l); // append $l symbols $c
+
+	/**
+	 * Finish loading and free $b
+	 *
+	 * @return 0 on success; -1 if the runs do not match the counts given to mr_build_init(), leaving $mr unusable
+	 */
+	int mr_build_finish(mrbuild_t *b);
+
 	void mr_print_tree(const mrope_t *mr);
 	void mr_dump(mrope_t *mr, FILE *fp);
-	mrope_t *mr_restore(FILE *fp);
+	mrope_t *mr_restore(FILE *fp); // NULL if $fp is not in the FMR format written by mr_dump()
+
+	/**
+	 * Dump the index in the memory-mappable FMR format, read by mr_restore_mmap()
+	 */
+	void mr_dump_mmap(const mrope_t *mr, FILE *fp);
+
+	/**
+	 * Map an index written by mr_dump_mmap()
+	 *
+	 * The file is mapped privately and is not parsed: the index can be
+	 * queried right away and leaves are read from the file on demand. The
+	 * first insertion into a leaf gives the process a private copy of its
+	 * page; the file itself is never modified.
+	 *
+	 * @param fn    file name
+	 *
+	 * @return the index, or NULL if $fn cannot be mapped or is not in this format
+	 */
+	mrope_t *mr_restore_mmap(const char *fn);
 
 #ifdef __cplusplus
 }
@@ -90,8 +368,7 @@ static inline int64_t mr_get_c(const mrope_t *mr, int64_t c[6])
 	for (a = 0; a < 6; ++a) c[a] = 0;
 	for (a = 0; a < 6; ++a) {
 		for (b = 0; b < 6; ++b)
-			c[b] += mr->r[a]->c[b];
-		tot += c[b];
+			c[b] += mr->r[a]->c[b], tot += mr->r[a]->c[b];
 	}
 	return tot;
 }
@@ -105,6 +382,15 @@ static inline int64_t mr_get_ac(const mrope_t *mr, int64_t ac[7])
 	return tot;
 }
 
+static inline void mr_set_intv(const mrope_t *mr, int c, mrintv_t *ik) // the bi-interval of symbol $c
+{
+	int64_t ac[7];
+	mr_get_ac(mr, ac);
+	ik->x[0] = ac[c], ik->x[2] = ac[c+1] - ac[c];
+	ik->x[1] = ac[c >= 1 && c <= 4? 5 - c : c];
+	ik->info = 0;
+}
+
 static inline int64_t mr_get_tot(const mrope_t *mr)
 {
 	int a, b;
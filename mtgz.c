@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "mtgz.h"
+
+#define MTGZ_RAW   0
+#define MTGZ_GZIP  1
+#define MTGZ_BGZF  2
+
+#define MTGZ_IBUF_LEN 0x10000
+#define BGZF_MAX_BLK  0x10000 // maximum size of a BGZF block, compressed or not
+
+typedef struct {
+	int n_blk, n_done, i_next; // $i_next: the next block to inflate; protected by mtgz_s::lock
+	int *clen, *ulen; // compressed and uncompressed block sizes; $ulen<0 for a corrupted block
+	uint8_t *cdata, *udata; // each block takes BGZF_MAX_BLK bytes
+} mtgz_batch_t;
+
+struct mtgz_s {
+	int fd, type, n_threads, is_eof, err;
+	int ib, ie; // the unconsumed part of $ibuf
+	uint8_t *ibuf;
+	z_stream zs; // for MTGZ_GZIP, and for BGZF with n_threads<=1
+	// BGZF
+	int max_blk, cur, i_blk, i_byte; // $cur: the batch being consumed; $i_blk/$i_byte: position in the batch
+	mtgz_batch_t b[2]; // one batch is consumed while the other is being inflated
+	int to_exit;
+	pthread_t *tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv_work, cv_done;
+};
+
+/*************
+ *** Input ***
+ *************/
+
+static int mtgz_fill(mtgz_t *fp) // refill the input buffer; return the number of bytes available
+{
+	int n;
+	if (fp->ib < fp->ie) return fp->ie - fp->ib;
+	fp->ib = fp->ie = 0;
+	while ((n = read(fp->fd, fp->ibuf, MTGZ_IBUF_LEN)) < 0 && errno == EINTR);
+	if (n < 0) fp->err = 1, n = 0;
+	return fp->ie = n;
+}
+
+static int mtgz_fread(mtgz_t *fp, uint8_t *dst, int len) // read raw bytes from the input
+{
+	int n = 0;
+	while (n < len && mtgz_fill(fp) > 0) {
+		int l = fp->ie - fp->ib < len - n? fp->ie - fp->ib : len - n;
+		memcpy(dst + n, fp->ibuf + fp->ib, l);
+		fp->ib += l, n += l;
+	}
+	return n;
+}
+
+/************
+ *** BGZF ***
+ ************/
+
+static int bgzf_bsize(const uint8_t *h, int xlen) // find the BC subfield; return the block size or -1
+{
+	int i, bsize = -1;
+	for (i = 12; i + 4 <= 12 + xlen; i += 4 + (h[i+2] | h[i+3]<<8))
+		if (h[i] == 66 && h[i+1] == 67 && (h[i+2] | h[i+3]<<8) == 2 && i + 6 <= 12 + xlen)
+			bsize = (h[i+4] | h[i+5]<<8) + 1;
+	return bsize;
+}
+
+static int bgzf_read_blk(mtgz_t *fp, uint8_t *h) // read one compressed block; 0 on EOF and -1 on errors
+{
+	int n, xlen, bsize;
+	if ((n = mtgz_fread(fp, h, 12)) == 0) return 0;
+	if (n < 12 || h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3]&4)) return -1;
+	xlen = h[10] | h[11]<<8;
+	if (mtgz_fread(fp, h + 12, xlen) < xlen) return -1;
+	bsize = bgzf_bsize(h, xlen);
+	if (bsize < 12 + xlen + 8 || bsize > BGZF_MAX_BLK) return -1;
+	n = bsize - 12 - xlen;
+	return mtgz_fread(fp, h + 12 + xlen, n) < n? -1 : bsize;
+}
+
+static int bgzf_inflate(z_stream *zs, const uint8_t *c, int clen, uint8_t *u) // return the uncompressed size or -1
+{
+	int xlen = c[10] | c[11]<<8;
+	const uint8_t *t = c + clen - 8; // the gzip trailer: CRC32 and ISIZE
+	uint32_t crc = t[0] | t[1]<<8 | t[2]<<16 | (uint32_t)t[3]<<24;
+	uint32_t ulen = t[4] | t[5]<<8 | t[6]<<16 | (uint32_t)t[7]<<24;
+	if (ulen > BGZF_MAX_BLK) return -1;
+	inflateReset(zs);
+	zs->next_in = (Bytef*)c + 12 + xlen, zs->avail_in = clen - 12 - xlen - 8;
+	zs->next_out = u, zs->avail_out = BGZF_MAX_BLK;
+	if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->total_out != ulen) return -1;
+	if (crc32(crc32(0L, Z_NULL, 0), u, ulen) != crc) return -1;
+	return ulen;
+}
+
+static void *bgzf_worker(void *data)
+{
+	mtgz_t *fp = (mtgz_t*)data;
+	z_stream zs;
+	memset(&zs, 0, sizeof(z_stream));
+	inflateInit2(&zs, -15);
+	pthread_mutex_lock(&fp->lock);
+	for (;;) {
+		mtgz_batch_t *b = 0;
+		int i, j;
+		for (j = 0; j < 2; ++j) { // the batch being consumed goes first
+			mtgz_batch_t *t = &fp->b[fp->cur ^ j];
+			if (t->i_next < t->n_blk) {
+				b = t;
+				break;
+			}
+		}
+		if (b == 0) {
+			if (fp->to_exit) break;
+			pthread_cond_wait(&fp->cv_work, &fp->lock);
+			continue;
+		}
+		i = b->i_next++;
+		pthread_mutex_unlock(&fp->lock);
+		b->ulen[i] = bgzf_inflate(&zs, b->cdata + (size_t)i * BGZF_MAX_BLK, b->clen[i], b->udata + (size_t)i * BGZF_MAX_BLK);
+		pthread_mutex_lock(&fp->lock);
+		if (++b->n_done == b->n_blk) pthread_cond_broadcast(&fp->cv_done);
+	}
+	pthread_mutex_unlock(&fp->lock);
+	inflateEnd(&zs);
+	return 0;
+}
+
+static void bgzf_submit(mtgz_t *fp, mtgz_batch_t *b, int flip) // read the next batch of blocks and queue them for inflation; with $flip, make the other batch current
+{
+	int n = 0, l;
+	while (n < fp->max_blk && !fp->is_eof) {
+		l = bgzf_read_blk(fp, b->cdata + (size_t)n * BGZF_MAX_BLK);
+		if (l <= 0) {
+			fp->is_eof = 1;
+			if (l < 0) fp->err = 1;
+		} else b->clen[n++] = l;
+	}
+	if (fp->n_threads <= 1) {
+		int i;
+		for (i = 0; i < n; ++i)
+			b->ulen[i] = bgzf_inflate(&fp->zs, b->cdata + (size_t)i * BGZF_MAX_BLK, b->clen[i], b->udata + (size_t)i * BGZF_MAX_BLK);
+		b->n_blk = b->n_done = b->i_next = n;
+		if (flip) fp->cur ^= 1;
+		return;
+	}
+	pthread_mutex_lock(&fp->lock); // the workers read $cur under the lock to pick a batch
+	b->n_blk = n, b->n_done = b->i_next = 0;
+	if (flip) fp->cur ^= 1;
+	pthread_cond_broadcast(&fp->cv_work);
+	pthread_mutex_unlock(&fp->lock);
+}
+
+static void bgzf_wait(mtgz_t *fp, mtgz_batch_t *b)
+{
+	if (fp->n_threads <= 1) return;
+	pthread_mutex_lock(&fp->lock);
+	while (b->n_done < b->n_blk)
+		pthread_cond_wait(&fp->cv_done, &fp->lock);
+	pthread_mutex_unlock(&fp->lock);
+}
+
+static int bgzf_read(mtgz_t *fp, uint8_t *buf, int len)
+{
+	int n = 0;
+	while (n < len) {
+		mtgz_batch_t *b = &fp->b[fp->cur];
+		int l;
+		if (fp->i_blk == b->n_blk) { // this batch is used up
+			if (b->n_blk == 0) break; // EOF
+			bgzf_submit(fp, b, 1);
+			fp->i_blk = fp->i_byte = 0;
+			bgzf_wait(fp, &fp->b[fp->cur]);
+			continue;
+		}
+		if (b->ulen[fp->i_blk] < 0) { // corrupted block; stop here
+			fp->err = 1;
+			break;
+		}
+		l = b->ulen[fp->i_blk] - fp->i_byte;
+		l = l < len - n? l : len - n;
+		memcpy(buf + n, b->udata + (size_t)fp->i_blk * BGZF_MAX_BLK + fp->i_byte, l);
+		n += l, fp->i_byte += l;
+		if (fp->i_byte == b->ulen[fp->i_blk])
+			++fp->i_blk, fp->i_byte = 0;
+	}
+	return n;
+}
+
+static void bgzf_init(mtgz_t *fp)
+{
+	int j, i;
+	fp->max_blk = (fp->n_threads > 1? fp->n_threads : 1) * MTGZ_BLK_PER_THR;
+	for (j = 0; j < 2; ++j) {
+		mtgz_batch_t *b = &fp->b[j];
+		b->clen = (int*)calloc(fp->max_blk, sizeof(int));
+		b->ulen = (int*)calloc(fp->max_blk, sizeof(int));
+		b->cdata = (uint8_t*)malloc((size_t)fp->max_blk * BGZF_MAX_BLK);
+		b->udata = (uint8_t*)malloc((size_t)fp->max_blk * BGZF_MAX_BLK);
+	}
+	if (fp->n_threads > 1) {
+		pthread_mutex_init(&fp->lock, 0);
+		pthread_cond_init(&fp->cv_work, 0);
+		pthread_cond_init(&fp->cv_done, 0);
+		fp->tid = (pthread_t*)calloc(fp->n_threads, sizeof(pthread_t));
+		for (i = 0; i < fp->n_threads; ++i)
+			pthread_create(&fp->tid[i], 0, bgzf_worker, fp);
+	} else inflateInit2(&fp->zs, -15);
+	bgzf_submit(fp, &fp->b[0], 0);
+	bgzf_submit(fp, &fp->b[1], 0);
+	bgzf_wait(fp, &fp->b[0]);
+}
+
+/*****************************
+ *** Plain gzip and others ***
+ *****************************/
+
+static int gz_next_member(mtgz_t *fp) // whether another member follows; the first two bytes must be the gzip magic
+{
+	int n;
+	if (fp->ie - fp->ib < 2) { // move what is left to the front and read more
+		memmove(fp->ibuf, fp->ibuf + fp->ib, fp->ie - fp->ib);
+		fp->ie -= fp->ib, fp->ib = 0;
+		while (fp->ie < 2) {
+			if ((n = read(fp->fd, fp->ibuf + fp->ie, MTGZ_IBUF_LEN - fp->ie)) > 0) fp->ie += n;
+			else if (n == 0 || errno != EINTR) {
+				if (n < 0) fp->err = 1;
+				break;
+			}
+		}
+	}
+	return fp->ie - fp->ib >= 2 && fp->ibuf[fp->ib] == 31 && fp->ibuf[fp->ib+1] == 139;
+}
+
+static int gz_read(mtgz_t *fp, uint8_t *buf, int len)
+{
+	z_stream *zs = &fp->zs;
+	zs->next_out = buf, zs->avail_out = len;
+	while (zs->avail_out > 0 && !fp->err && !fp->is_eof) {
+		int ret;
+		if (fp->ib == fp->ie && mtgz_fill(fp) == 0) {
+			if (zs->total_in > 0) fp->err = 1; // EOF in the middle of a member
+			break;
+		}
+		zs->next_in = fp->ibuf + fp->ib, zs->avail_in = fp->ie - fp->ib;
+		ret = inflate(zs, Z_NO_FLUSH);
+		fp->ib = fp->ie - zs->avail_in;
+		if (ret == Z_STREAM_END) { // there may be more members; other trailing bytes are ignored, as gzread() does
+			inflateReset(zs);
+			if (!gz_next_member(fp)) fp->is_eof = 1;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) fp->err = 1;
+	}
+	return len - zs->avail_out;
+}
+
+static int raw_read(mtgz_t *fp, uint8_t *buf, int len)
+{
+	int n = 0, l;
+	if (fp->ib < fp->ie) n = mtgz_fread(fp, buf, len);
+	while (n < len && (l = read(fp->fd, buf + n, len - n)) != 0) {
+		if (l < 0) {
+			if (errno == EINTR) continue;
+			fp->err = 1;
+			break;
+		}
+		n += l;
+	}
+	return n;
+}
+
+/*****************
+ *** Interface ***
+ *****************/
+
+mtgz_t *mtgz_open(const char *fn, int n_threads)
+{
+	mtgz_t *fp;
+	int fd, n;
+	fd = fn && strcmp(fn, "-")? open(fn, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) return 0;
+	fp = (mtgz_t*)calloc(1, sizeof(mtgz_t));
+	fp->fd = fd, fp->n_threads = n_threads;
+	fp->ibuf = (uint8_t*)malloc(MTGZ_IBUF_LEN);
+	while (fp->ie < 18 && (n = read(fd, fp->ibuf + fp->ie, MTGZ_IBUF_LEN - fp->ie)) != 0) { // peek the first 18 bytes
+		if (n > 0) fp->ie += n;
+		else if (errno != EINTR) break;
+	}
+	if (fp->ie >= 2 && fp->ibuf[0] == 31 && fp->ibuf[1] == 139) {
+		uint8_t *h = fp->ibuf;
+		if (fp->ie >= 18 && h[2] == 8 && (h[3]&4) && 12 + (h[10] | h[11]<<8) <= fp->ie && bgzf_bsize(h, h[10] | h[11]<<8) > 0) {
+			fp->type = MTGZ_BGZF;
+			bgzf_init(fp);
+		} else {
+			fp->type = MTGZ_GZIP;
+			inflateInit2(&fp->zs, 15 + 16);
+		}
+	} else fp->type = MTGZ_RAW;
+	return fp;
+}
+
+int mtgz_read(mtgz_t *fp, void *buf, int len)
+{
+	if (fp->type == MTGZ_BGZF) return bgzf_read(fp, (uint8_t*)buf, len);
+	else if (fp->type == MTGZ_GZIP) return gz_read(fp, (uint8_t*)buf, len);
+	else return raw_read(fp, (uint8_t*)buf, len);
+}
+
+int mtgz_is_bgzf(const mtgz_t *fp)
+{
+	return fp->type == MTGZ_BGZF;
+}
+
+int mtgz_close(mtgz_t *fp)
+{
+	int i, ret;
+	if (fp == 0) return 0;
+	if (fp->type == MTGZ_BGZF) {
+		if (fp->n_threads > 1) {
+			pthread_mutex_lock(&fp->lock);
+			fp->to_exit = 1;
+			pthread_cond_broadcast(&fp->cv_work);
+			pthread_mutex_unlock(&fp->lock);
+			for (i = 0; i < fp->n_threads; ++i) pthread_join(fp->tid[i], 0);
+			free(fp->tid);
+			pthread_mutex_destroy(&fp->lock);
+			pthread_cond_destroy(&fp->cv_work);
+			pthread_cond_destroy(&fp->cv_done);
+		} else inflateEnd(&fp->zs);
+		for (i = 0; i < 2; ++i) {
+			free(fp->b[i].clen); free(fp->b[i].ulen);
+			free(fp->b[i].cdata); free(fp->b[i].udata);
+		}
+	} else if (fp->type == MTGZ_GZIP) inflateEnd(&fp->zs);
+	if (fp->fd != STDIN_FILENO) close(fp->fd);
+	ret = fp->err? -1 : 0;
+	free(fp->ibuf); free(fp);
+	return ret;
+}
@@ -0,0 +1,48 @@
+#ifndef MTGZ_H
+#define MTGZ_H
+
+#include <stdint.h>
+
+#define MTGZ_BLK_PER_THR 16 // BGZF blocks per thread in one batch
+
+struct mtgz_s;
+typedef struct mtgz_s mtgz_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	/**
+	 * Open a file for reading
+	 *
+	 * BGZF input is inflated on $n_threads threads, ahead of the reader.
+	 * Other gzip files and uncompressed files are read on the calling thread.
+	 *
+	 * @param fn          file name; NULL or "-" for stdin
+	 * @param n_threads   number of decompression threads; <=1 to inflate BGZF blocks on the calling thread
+	 *
+	 * @return file handler, or NULL if the file cannot be opened
+	 */
+	mtgz_t *mtgz_open(const char *fn, int n_threads);
+
+	/**
+	 * Read decompressed data
+	 *
+	 * @return number of bytes read; 0 on EOF or errors
+	 */
+	int mtgz_read(mtgz_t *fp, void *buf, int len);
+
+	int mtgz_is_bgzf(const mtgz_t *fp);
+
+	/**
+	 * Close the file
+	 *
+	 * @return 0 on success; -1 if there were decompression errors
+	 */
+	int mtgz_close(mtgz_t *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
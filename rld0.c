@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include "rld0.h"
 
 #define RLD_IBITS_PLUS 4
@@ -160,41 +161,101 @@ int rld_enc(rld_t *e, rlditr_t *itr, int64_t l, uint8_t c)
 	return 0;
 }
 
-void rld_rank_index(rld_t *e)
+static inline void rld_add_hdr(const rld_t *e, const uint64_t *p, uint64_t *cnt) // add the counts in the header at $p to $cnt
 {
-	uint64_t last, n_blks, i, k, *cnt;
+	int j, type = rld_block_type(*p);
+	if (type == 0) {
+		uint16_t *q = (uint16_t*)p;
+		for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
+	} else if (type == 1) {
+		uint32_t *q = (uint32_t*)p;
+		for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j] & 0x3fffffff;
+	} else {
+		uint64_t *q = (uint64_t*)p;
+		for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
+	}
+}
+
+typedef struct {
+	rld_t *e;
+	uint64_t beg, end; // blocks to index, in words
+	uint64_t k, k_lim; // first frame to consider; frames from $k_lim on are written by the next thread
+	uint64_t cnt[256]; // counts before $beg after the first pass
+	int pass;
+} rldidx_t;
+
+static void *rld_index_worker(void *data)
+{
+	rldidx_t *w = (rldidx_t*)data;
+	rld_t *e = w->e;
+	uint64_t i, k = w->k, sum, *cnt = w->cnt;
 	int j;
+	for (i = w->beg; i < w->end; i += e->ssize) {
+		rld_add_hdr(e, rld_seek_blk(e, i), cnt);
+		if (w->pass == 0) continue;
+		for (j = 0, sum = 0; j < e->asize; ++j) sum += cnt[j];
+		while (sum >= k<<e->ibits) ++k;
+		if (k < w->k_lim) {
+			uint64_t x = k * e->asize1;
+			e->frame[x] = i;
+			for (j = 0; j < e->asize; ++j) e->frame[x + j + 1] = cnt[j];
+		}
+	}
+	w->k = k;
+	return 0;
+}
+
+#define RLD_IDX_MIN_BLKS 0x10000 // index on one thread below this number of blocks per thread
+
+static void rld_rank_index(rld_t *e, int n_threads)
+{
+	uint64_t last, n_blks, k;
+	rldidx_t *w;
+	int j, t;
 
 	n_blks = e->n_bytes * 8 / 64 / e->ssize + 1;
 	last = rld_last_blk(e);
-	cnt = alloca(e->asize * 8);
 	e->ibits = ilog2(e->mcnt[0] / n_blks) + RLD_IBITS_PLUS;
 	e->n_frames = ((e->mcnt[0] + (1ll<<e->ibits) - 1) >> e->ibits) + 1;
 	e->frame = xcalloc(e->n_frames * e->asize1, 8);
 	e->frame[0] = 0;
-	for (j = 0; j < e->asize; ++j) cnt[j] = 0;
-	for (i = e->ssize, k = 1; i <= last; i += e->ssize) {
-		uint64_t sum, *p = rld_seek_blk(e, i);
-		int type = rld_block_type(*p);
-		if (type == 0) {
-			uint16_t *q = (uint16_t*)p;
-			for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
-		} else if (type == 1) {
-			uint32_t *q = (uint32_t*)p;
-			for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j] & 0x3fffffff;
-		} else {
-			uint64_t *q = (uint64_t*)p;
-			for (j = 1; j <= e->asize; ++j) cnt[j-1] += q[j];
-		}
-		for (j = 0, sum = 0; j < e->asize; ++j) sum += cnt[j];
-		while (sum >= k<<e->ibits) ++k;
-		if (k < e->n_frames) {
-			uint64_t x = k * e->asize1;
-			e->frame[x] = i;
-			for (j = 0; j < e->asize; ++j) e->frame[x + j + 1] = cnt[j];
+	if (n_threads > (int)(n_blks / RLD_IDX_MIN_BLKS)) n_threads = n_blks / RLD_IDX_MIN_BLKS;
+	if (n_threads < 1) n_threads = 1;
+	w = xcalloc(n_threads, sizeof(rldidx_t));
+	for (t = 0; t < n_threads; ++t) { // split blocks $ssize..$last evenly
+		w[t].e = e;
+		w[t].beg = e->ssize + (last / e->ssize) * t / n_threads * e->ssize;
+		w[t].end = e->ssize + (last / e->ssize) * (t + 1) / n_threads * e->ssize;
+	}
+	if (n_threads > 1) { // the first pass counts symbols in each range
+		pthread_t *tid = alloca(n_threads * sizeof(pthread_t));
+		for (t = 0; t < n_threads; ++t) pthread_create(&tid[t], 0, rld_index_worker, &w[t]);
+		for (t = 0; t < n_threads; ++t) pthread_join(tid[t], 0);
+		for (t = n_threads - 1; t >= 0; --t) { // turn the counts into those before each range
+			memset(w[t].cnt, 0, sizeof(w[t].cnt));
+			for (k = 0; (int)k < t; ++k)
+				for (j = 0; j < e->asize; ++j) w[t].cnt[j] += w[k].cnt[j];
 		}
 	}
-	assert(k >= e->n_frames - 1);
+	for (t = 0; t < n_threads; ++t) { // the next thread owns the frame its first block falls in
+		uint64_t sum = 0, tmp[256];
+		w[t].pass = 1;
+		for (j = 0; j < e->asize; ++j) sum += w[t].cnt[j];
+		w[t].k = (sum >> e->ibits) + 1;
+		if (t + 1 < n_threads) {
+			memcpy(tmp, w[t+1].cnt, e->asize * 8);
+			rld_add_hdr(e, rld_seek_blk(e, w[t+1].beg), tmp);
+			for (j = 0, sum = 0; j < e->asize; ++j) sum += tmp[j];
+			w[t].k_lim = (sum >> e->ibits) + 1;
+		} else w[t].k_lim = e->n_frames;
+	}
+	if (n_threads > 1) {
+		pthread_t *tid = alloca(n_threads * sizeof(pthread_t));
+		for (t = 0; t < n_threads; ++t) pthread_create(&tid[t], 0, rld_index_worker, &w[t]);
+		for (t = 0; t < n_threads; ++t) pthread_join(tid[t], 0);
+	} else rld_index_worker(&w[0]);
+	assert(w[n_threads-1].k >= e->n_frames - 1);
+	free(w);
 	for (k = 1; k < e->n_frames; ++k) { // fill zero cells
 		uint64_t x = k * e->asize1;
 		if (e->frame[x] == 0) {
@@ -204,7 +265,7 @@ void rld_rank_index(rld_t *e)
 	}
 }
 
-uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
+uint64_t rld_enc_finish_mt(rld_t *e, rlditr_t *itr, int n_threads)
 {
 	int i;
 	if (itr->l) rld_enc1(e, itr, itr->l, itr->c);
@@ -212,10 +273,63 @@ uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
 	e->n_bytes = (((uint64_t)(e->n - 1) * RLD_LSIZE) + (itr->p - *itr->i)) * 8;
 	// recompute e->cnt as the accumulative count; e->mcnt[] keeps the marginal counts
 	for (e->cnt[0] = 0, i = 1; i <= e->asize; ++i) e->cnt[i] += e->cnt[i - 1];
-	rld_rank_index(e);
+	rld_rank_index(e, n_threads);
 	return e->n_bytes;
 }
 
+uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr)
+{
+	return rld_enc_finish_mt(e, itr, 1);
+}
+
+static inline void rld_get_hdr(const rld_t *e, const uint64_t *p, uint64_t *cnt) // counts in the block before $p
+{
+	int i, type = rld_block_type(*p);
+	for (i = 0; i <= e->asize; ++i)
+		cnt[i] = type == 0? ((uint16_t*)p)[i] : type == 1? ((uint32_t*)p)[i] : p[i];
+	for (i = 0; i <= e->asize; ++i) // clear the type bits, which fall in the highest entry of the first word
+		if ((i + 1) * (type == 0? 16 : type == 1? 32 : 64) == 64) cnt[i] &= (type == 0? 0x3fff : type == 1? 0x3fffffff : 0x3fffffffffffffffULL);
+}
+
+void rld_cat(rld_t *e, rlditr_t *itr, rld_t *s, rlditr_t *sitr)
+{
+	uint64_t k, last, cnt[256];
+	int i;
+	if (itr->l) rld_enc1(e, itr, itr->l, itr->c), itr->l = 0;
+	if (sitr->l) rld_enc1(s, sitr, sitr->l, sitr->c), sitr->l = 0;
+	last = (sitr->i - s->z) * RLD_LSIZE + (sitr->shead - *sitr->i); // the block being encoded in $s
+	for (k = 0; k <= last; k += s->ssize) {
+		uint64_t *b = rld_seek_blk(s, k), *src = b + s->offset0[rld_block_type(*b)], *dst, *stail;
+		int64_t n, cap;
+		if (k < last) {
+			rld_get_hdr(s, rld_seek_blk(s, k + s->ssize), cnt);
+			stail = b + s->ssize - ((k & RLD_LMASK) + s->ssize == RLD_LSIZE? 2 : 1);
+			for (n = stail - src + 1; n > 0 && src[n-1] == 0; --n); // words used; a full word of zeros never occurs in the data
+		} else {
+			for (i = 0; i <= s->asize; ++i) cnt[i] = s->cnt[i] - s->mcnt[i];
+			n = sitr->p - src + (sitr->r < 64);
+		}
+		if (cnt[0] == 0) continue; // an empty block
+		if (itr->p != itr->shead + e->offset0[rld_block_type(*itr->shead)] || itr->r != 64) // unless the current block is empty
+			enc_next_block(e, itr);
+		dst = itr->shead + e->offset0[rld_block_type(*itr->shead)];
+		cap = itr->stail - dst + 1;
+		if (n <= cap) { // copy the block as is
+			memcpy(dst, src, n * 8);
+			for (i = 0; i <= e->asize; ++i) e->cnt[i] += cnt[i];
+			if (k < last) itr->p = itr->stail, itr->r = 0; // the block is closed; the next run goes to a new block
+			else itr->p = dst + (sitr->p - src), itr->r = sitr->r;
+		} else { // the block does not fit at this position; re-encode its runs
+			rlditr_t t;
+			int64_t l;
+			int c;
+			rld_itr_init(s, &t, k);
+			while ((l = rld_dec0(s, &t, &c)) != 0 && c <= s->asize)
+				rld_enc1(e, itr, l, c);
+		}
+	}
+}
+
 /*****************
  * Save and load *
  *****************/
@@ -470,6 +584,26 @@ void rld_rank2a(const rld_t *e, uint64_t k, uint64_t l, uint64_t *ok, uint64_t *
 	}
 }
 
+#define RLD_BATCH 16 // queries whose memory accesses are overlapped
+
+void rld_rank2a_batch(const rld_t *e, int64_t n, const uint64_t *k, const uint64_t *l, uint64_t *ok, uint64_t *ol)
+{
+	int64_t i, j;
+	for (i = 0; i < n; i += RLD_BATCH) {
+		int64_t m = n - i < RLD_BATCH? n - i : RLD_BATCH;
+		for (j = 0; j < m; ++j) // the frames; rld_locate_blk() looks up the frame of k-1
+			__builtin_prefetch(e->frame + ((k[i+j]? k[i+j] - 1 : 0) >> e->ibits) * e->asize1);
+		for (j = 0; j < m; ++j) { // the first blocks after the frames, which are scanned from there
+			const uint64_t *z = e->frame + ((k[i+j]? k[i+j] - 1 : 0) >> e->ibits) * e->asize1;
+			const uint64_t *q = rld_seek_blk(e, *z);
+			__builtin_prefetch(q);
+			__builtin_prefetch(q + e->ssize);
+		}
+		for (j = 0; j < m; ++j)
+			rld_rank2a(e, k[i+j], l[i+j], ok + (i+j) * e->asize, ol + (i+j) * e->asize);
+	}
+}
+
 int rld_extend(const rld_t *e, const rldintv_t *ik, rldintv_t ok[6], int is_back)
 { // TODO: this can be accelerated a little by using rld_rank1a() when ik.x[2]==1
 	uint64_t tk[6], tl[6];
@@ -487,3 +621,32 @@ int rld_extend(const rld_t *e, const rldintv_t *ik, rldintv_t ok[6], int is_back
 	ok[5].x[is_back] = ok[1].x[is_back] + tl[1];
 	return 0;
 }
+
+void rld_extend_batch(const rld_t *e, int64_t n, const rldintv_t *ik, rldintv_t *ok, int is_back)
+{
+	uint64_t *k, *l, *tk, *tl;
+	int64_t i;
+	if (n <= 0) return;
+	k = malloc(n * 8 * 2 + n * 6 * 8 * 2);
+	l = k + n, tk = l + n, tl = tk + n * 6;
+	for (i = 0; i < n; ++i)
+		k[i] = ik[i].x[!is_back], l[i] = ik[i].x[!is_back] + ik[i].x[2];
+	rld_rank2a_batch(e, n, k, l, tk, tl);
+	for (i = 0; i < n; ++i) { // the same as rld_extend()
+		uint64_t *tki = tk + i * 6, *tli = tl + i * 6;
+		rldintv_t *oki = ok + i * 6;
+		int a;
+		for (a = 0; a < 6; ++a) {
+			oki[a].x[!is_back] = e->cnt[a] + tki[a];
+			oki[a].x[2] = (tli[a] -= tki[a]);
+		}
+		oki[0].x[is_back] = ik[i].x[is_back];
+		oki[4].x[is_back] = oki[0].x[is_back] + tli[0];
+		oki[3].x[is_back] = oki[4].x[is_back] + tli[4];
+		oki[2].x[is_back] = oki[3].x[is_back] + tli[3];
+		oki[1].x[is_back] = oki[2].x[is_back] + tli[2];
+		oki[5].x[is_back] = oki[1].x[is_back] + tli[1];
+	}
+	free(k);
+}
+
@@ -58,6 +58,23 @@ extern "C" {
 	void rld_itr_init(const rld_t *e, rlditr_t *itr, uint64_t k);
 	int rld_enc(rld_t *e, rlditr_t *itr, int64_t l, uint8_t c);
 	uint64_t rld_enc_finish(rld_t *e, rlditr_t *itr);
+	uint64_t rld_enc_finish_mt(rld_t *e, rlditr_t *itr, int n_threads); // build the rank index on $n_threads threads
+
+	/**
+	 * Append a separately encoded segment
+	 *
+	 * $s must come from rld_init() with the same parameters as $e and must
+	 * not have been finished. Blocks are copied when possible and re-encoded
+	 * otherwise. Runs adjacent across the boundary are not merged. $s can be
+	 * destroyed afterwards; call rld_enc_finish() on $e after the last
+	 * segment.
+	 *
+	 * @param e       the index being encoded
+	 * @param itr     iterator of $e
+	 * @param s       the segment
+	 * @param sitr    iterator of $s
+	 */
+	void rld_cat(rld_t *e, rlditr_t *itr, rld_t *s, rlditr_t *sitr);
 
 	uint64_t rld_rank11(const rld_t *e, uint64_t k, int c);
 	int rld_rank1a(const rld_t *e, uint64_t k, uint64_t *ok);
@@ -66,6 +83,24 @@ extern "C" {
 
 	int rld_extend(const rld_t *e, const rldintv_t *ik, rldintv_t ok[6], int is_back);
 
+	/**
+	 * Compute rld_rank2a() for many pairs
+	 *
+	 * Queries are processed in small groups whose frames and first blocks
+	 * are prefetched together, so cache misses overlap.
+	 *
+	 * @param e       index
+	 * @param n       number of queries
+	 * @param k, l    (k[i],l[i]) is the i-th pair
+	 * @param ok, ol  (out) ranks of the i-th pair at ok[i*asize] and ol[i*asize]
+	 */
+	void rld_rank2a_batch(const rld_t *e, int64_t n, const uint64_t *k, const uint64_t *l, uint64_t *ok, uint64_t *ol);
+
+	/**
+	 * Call rld_extend() on $n intervals; the results of $ik[i] are at $ok[i*6]; requires asize==6
+	 */
+	void rld_extend_batch(const rld_t *e, int64_t n, const rldintv_t *ik, rldintv_t *ok, int is_back);
+
 #ifdef __cplusplus
 }
 #endif
@@ -6,8 +6,186 @@
 
 const uint8_t rle_auxtab[8] = { 0x01, 0x11, 0x21, 0x31, 0x03, 0x13, 0x07, 0x17 };
 
+// The kernels below decode the 1- and 2-byte runs in a 16-byte window at a time. Longer runs are left to rle_dec1().
+
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define RLE_HAVE_SIMD 1
+
+// find the complete runs in the 16-byte window at $p: skip leading continuation bytes and a trailing 2-byte run
+static inline int rle_win16(const uint8_t *p, int *end)
+{
+	int beg = 0;
+	while (beg < 16 && p[beg]>>6 == 2) ++beg;
+	*end = p[15]>>5 == 6? 15 : 16;
+	return beg;
+}
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+// if the window at $p has no runs longer than 2 bytes and the complete runs in it add up to less than $lim symbols,
+// put their per-symbol lengths in $s, set $n to the number of bytes used and return the total length;
+// return 0 if the runs reach $lim, or -1 if there is a longer run, with $beg and $n set to the first and the last such run
+static inline int rle_sum16(const uint8_t *p, int64_t lim, int64_t s[6], int *beg, int *n)
+{
+	const __m128i idx = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i v = _mm_loadu_si128((const __m128i*)p), len, sym, t, in, c1, c2, cc, zero = _mm_setzero_si128();
+	int a, b, e, tot;
+	if ((a = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(0xE0)), _mm_set1_epi8(0xE0)))) != 0) { // 4- or 8-byte runs
+		*beg = __builtin_ctz(a), *n = 31 - __builtin_clz(a);
+		return -1;
+	}
+	b = rle_win16(p, &e);
+	in = _mm_andnot_si128(_mm_cmpgt_epi8(_mm_set1_epi8(b), idx), _mm_cmpgt_epi8(_mm_set1_epi8(e), idx)); // bytes in [b,e)
+	c1 = _mm_cmpgt_epi8(zero, v); // not a 1-byte run
+	cc = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(0xC0)), _mm_set1_epi8(0x80)); // continuation bytes
+	c2 = _mm_andnot_si128(cc, c1); // leading bytes of 2-byte runs
+	len = _mm_andnot_si128(c1, _mm_and_si128(_mm_srli_epi16(v, 3), _mm_set1_epi8(0x0f)));
+	len = _mm_or_si128(len, _mm_and_si128(c2, _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi8(0x18)), 3)));
+	len = _mm_and_si128(in, _mm_or_si128(len, _mm_and_si128(cc, _mm_and_si128(v, _mm_set1_epi8(0x3f)))));
+	t = _mm_sad_epu8(len, zero);
+	tot = _mm_cvtsi128_si32(t) + _mm_extract_epi16(t, 4);
+	if (tot >= lim) return 0;
+	sym = _mm_and_si128(v, _mm_set1_epi8(7));
+	sym = _mm_or_si128(_mm_andnot_si128(cc, sym), _mm_and_si128(cc, _mm_slli_si128(sym, 1))); // a continuation byte takes the symbol of the previous byte
+	for (a = 0; a < 6; ++a) {
+		t = _mm_sad_epu8(_mm_and_si128(len, _mm_cmpeq_epi8(sym, _mm_set1_epi8(a))), zero);
+		s[a] = _mm_cvtsi128_si32(t) + _mm_extract_epi16(t, 4);
+	}
+	*beg = b, *n = e - b;
+	return tot;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static inline int rle_sum16(const uint8_t *p, int64_t lim, int64_t s[6], int *beg, int *n)
+{
+	static const uint8_t idx0[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+	uint8x16_t v = vld1q_u8(p), idx = vld1q_u8(idx0), len, sym, in, c1, c2, cc;
+	int a, b, e, tot;
+	if (vmaxvq_u8(vcgeq_u8(v, vdupq_n_u8(0xE0)))) {
+		for (a = 0; a < 16 && p[a] < 0xE0; ++a);
+		*beg = a;
+		for (a = 15; a >= 0 && p[a] < 0xE0; --a);
+		*n = a;
+		return -1;
+	}
+	b = rle_win16(p, &e);
+	in = vandq_u8(vcgeq_u8(idx, vdupq_n_u8(b)), vcltq_u8(idx, vdupq_n_u8(e)));
+	c1 = vcgeq_u8(v, vdupq_n_u8(0x80));
+	cc = vceqq_u8(vandq_u8(v, vdupq_n_u8(0xC0)), vdupq_n_u8(0x80));
+	c2 = vbicq_u8(c1, cc);
+	len = vbslq_u8(c1, vandq_u8(c2, vshlq_n_u8(vandq_u8(v, vdupq_n_u8(0x18)), 3)), vshrq_n_u8(v, 3));
+	len = vandq_u8(in, vorrq_u8(len, vandq_u8(cc, vandq_u8(v, vdupq_n_u8(0x3f)))));
+	tot = vaddlvq_u8(len);
+	if (tot >= lim) return 0;
+	sym = vandq_u8(v, vdupq_n_u8(7));
+	sym = vbslq_u8(cc, vextq_u8(vdupq_n_u8(0), sym, 15), sym);
+	for (a = 0; a < 6; ++a)
+		s[a] = vaddlvq_u8(vandq_u8(len, vceqq_u8(sym, vdupq_n_u8(a))));
+	*beg = b, *n = e - b;
+	return tot;
+}
+#endif
+
+#ifdef RLE_HAVE_SIMD
+// skip 1- and 2-byte runs while staying before $x; windows are not tried again before $nx, which is past the next long run,
+// or at $end once $x is close
+#define rle_skip_fwd(p, end, z, x, cnt, nx) do { \
+		int64_t _s[6]; \
+		int _t, _b, _n; \
+		while ((p) >= (nx) && (end) - (p) >= 16) { \
+			if ((_t = rle_sum16((p), (x) - (z), _s, &_b, &_n)) <= 0) { \
+				(nx) = _t == 0? (end) : (p) + _b + 1; \
+				break; \
+			} \
+			(z) += _t, (p) += _n; \
+			(cnt)[0] += _s[0], (cnt)[1] += _s[1], (cnt)[2] += _s[2], (cnt)[3] += _s[3], (cnt)[4] += _s[4], (cnt)[5] += _s[5]; \
+		} \
+	} while (0)
+// skip 1- and 2-byte runs backwardly while staying at or after $x
+#define rle_skip_bwd(p, beg, z, x, cnt, nx) do { \
+		int64_t _s[6]; \
+		int _t, _b, _n; \
+		while ((p) <= (nx) && (p) - (beg) >= 16) { \
+			if ((_t = rle_sum16((p) - 16, (z) - (x) + 1, _s, &_b, &_n)) <= 0) { \
+				(nx) = _t == 0? (beg) : (p) - 16 + _n; \
+				break; \
+			} \
+			(z) -= _t, (p) -= _n; \
+			(cnt)[0] -= _s[0], (cnt)[1] -= _s[1], (cnt)[2] -= _s[2], (cnt)[3] -= _s[3], (cnt)[4] -= _s[4], (cnt)[5] -= _s[5]; \
+		} \
+	} while (0)
+#else
+#define rle_skip_fwd(p, end, z, x, cnt, nx) ((void)(end), (void)(nx))
+#define rle_skip_bwd(p, beg, z, x, cnt, nx) ((void)(nx))
+#endif
+
+void rle_ck_build(uint8_t *block, int len)
+{
+	int j, a, n = rle_ck_n(len);
+	uint32_t *ck;
+	uint16_t *off;
+	const uint8_t *p, *q, *end;
+	int64_t cnt[6];
+	if (n == 0) return;
+	ck = rle_ck_cnt(block, len), off = rle_ck_off(block, len);
+	p = q = block + 2, end = p + *rle_nptr(block);
+	memset(cnt, 0, 48);
+	for (j = 0; j < n; ++j) {
+		int is_ok = 1;
+		while (q < end && q - p < (j + 1) * RLE_CK_STEP) {
+			int c;
+			int64_t l;
+			rle_dec1(q, c, l);
+			cnt[c] += l;
+		}
+		for (a = 0; a < 6; ++a) {
+			if (cnt[a] > UINT32_MAX) is_ok = 0;
+			ck[j*6+a] = cnt[a];
+		}
+		off[j] = is_ok? q - p : RLE_CK_NONE;
+	}
+}
+
+static inline int rle_ck_seek(const uint8_t *block, int len, int64_t x, int64_t cnt[6], int64_t *z)
+{ // find the last checkpoint before $x; return its offset, or 0 if there is none, and set $cnt and $z to the counts before it
+	int j, a, k = -1, n = rle_ck_n(len);
+	const uint32_t *ck;
+	const uint16_t *off;
+	memset(cnt, 0, 48), *z = 0;
+	if (n == 0) return 0;
+	ck = rle_ck_cnt(block, len), off = rle_ck_off(block, len);
+	for (j = 0; j < n && off[j] != RLE_CK_NONE; ++j) { // counts are cumulative, so invalid checkpoints are all at the end
+		const uint32_t *c = ck + j * 6;
+		int64_t y = (int64_t)c[0] + c[1] + c[2] + c[3] + c[4] + c[5];
+		if (y >= x) break;
+		k = j, *z = y;
+	}
+	if (k < 0) return 0;
+	for (a = 0; a < 6; ++a) cnt[a] = ck[k*6+a];
+	return off[k];
+}
+
+static inline void rle_ck_update(uint8_t *block, int len, int o, int diff, int a, int64_t rl)
+{ // $rl symbols $a have been inserted at byte $o and the runs after it have been moved by $diff bytes
+	int j, n = rle_ck_n(len);
+	uint32_t *ck;
+	uint16_t *off;
+	if (n == 0) return;
+	ck = rle_ck_cnt(block, len), off = rle_ck_off(block, len);
+	for (j = n - 1; j >= 0; --j) {
+		if (off[j] == RLE_CK_NONE) continue;
+		if (off[j] <= o) break;
+		if ((uint64_t)ck[j*6+a] + rl > UINT32_MAX) off[j] = RLE_CK_NONE;
+		else off[j] += diff, ck[j*6+a] += rl;
+	}
+}
+
 // insert symbol $a after $x symbols in $str; marginal counts added to $cnt; returns the size increase
-int rle_insert_cached(uint8_t *block, int64_t x, int a, int64_t rl, int64_t cnt[6], const int64_t ec[6], int *beg, int64_t bc[6])
+int rle_insert_cached(uint8_t *block, int len, int64_t x, int a, int64_t rl, int64_t cnt[6], const int64_t ec[6], int *beg, int64_t bc[6])
 {
 	uint16_t *nptr = (uint16_t*)block;
 	int diff;
@@ -27,21 +205,29 @@ int rle_insert_cached(uint8_t *block, int64_t x, int a, int64_t rl, int64_t cnt[
 			beg_l = 0, *beg = 0;
 			memset(bc, 0, 48);
 		}
+		if (rle_ck_n(len) && x - beg_l > RLE_CK_STEP) { // start from the closest checkpoint if the cached position is far behind
+			int64_t ckc[6], ckz;
+			int o = rle_ck_seek(block - 2, len, x, ckc, &ckz);
+			if (ckz > beg_l) beg_l = ckz, *beg = o, memcpy(bc, ckc, 48);
+		}
 		if (x == beg_l) {
 			p = q = block + (*beg); z = beg_l;
 			memcpy(cnt, bc, 48);
 		} else if (x - beg_l <= ((tot-beg_l)>>1) + ((tot-beg_l)>>3)) { // forward
 			z = beg_l; p = block + (*beg);
 			memcpy(cnt, bc, 48);
+			q = p; // where to try rle_skip_fwd() again
 			while (z < x) {
+				rle_skip_fwd(p, end, z, x, cnt, q);
 				rle_dec1(p, c, l);
 				z += l; cnt[c] += l;
 			}
 			for (q = p - 1; *q>>6 == 2; --q);
 		} else { // backward
 			memcpy(cnt, ec, 48);
-			z = tot; p = end;
+			z = tot; p = q = end;
 			while (z >= x) {
+				if (t == 0) rle_skip_bwd(p, block, z, x, cnt, q);
 				--p;
 				if (*p>>6 != 2) {
 					l |= *p>>7? (int64_t)rle_auxtab[*p>>3&7]>>4 << t : *p>>3;
@@ -84,16 +270,17 @@ int rle_insert_cached(uint8_t *block, int64_t x, int a, int64_t rl, int64_t cnt[
 			memmove(p + n_bytes2, p + n_bytes, end - p - n_bytes);
 		memcpy(p, tmp, n_bytes2);
 		diff = n_bytes2 - n_bytes;
+		rle_ck_update(block - 2, len, p - block, diff, a, rl);
 	}
 	return (*nptr += diff);
 }
 
-int rle_insert(uint8_t *block, int64_t x, int a, int64_t rl, int64_t cnt[6], const int64_t ec[6])
+int rle_insert(uint8_t *block, int len, int64_t x, int a, int64_t rl, int64_t cnt[6], const int64_t ec[6])
 {
 	int beg = 0;
 	int64_t bc[6];
 	memset(bc, 0, 48);
-	return rle_insert_cached(block, x, a, rl, cnt, ec, &beg, bc);
+	return rle_insert_cached(block, len, x, a, rl, cnt, ec, &beg, bc);
 }
 
 void rle_split(uint8_t *block, uint8_t *new_block)
@@ -109,9 +296,24 @@ void rle_split(uint8_t *block, uint8_t *new_block)
 void rle_count(const uint8_t *block, int64_t cnt[6])
 {
 	const uint8_t *q = block + 2, *end = q + *(uint16_t*)block;
+#ifdef RLE_HAVE_SIMD
+	const uint8_t *nx = q;
+#endif
 	while (q < end) {
 		int c;
 		int64_t l;
+#ifdef RLE_HAVE_SIMD
+		if (q >= nx && end - q >= 16) {
+			int64_t s[6];
+			int b, n;
+			if (rle_sum16(q, INT64_MAX, s, &b, &n) > 0) {
+				for (c = 0; c < 6; ++c) cnt[c] += s[c];
+				q += n;
+				continue;
+			}
+			nx = q + b + 1;
+		}
+#endif
 		rle_dec1(q, c, l);
 		cnt[c] += l;
 	}
@@ -131,7 +333,7 @@ void rle_print(const uint8_t *block, int expand)
 	putchar('\n');
 }
 
-void rle_rank2a(const uint8_t *block, int64_t x, int64_t y, int64_t *cx, int64_t *cy, const int64_t ec[6])
+void rle_rank2a(const uint8_t *block, int len, int64_t x, int64_t y, int64_t *cx, int64_t *cy, const int64_t ec[6])
 {
 	int a;
 	int64_t tot, cnt[6];
@@ -140,19 +342,28 @@ void rle_rank2a(const uint8_t *block, int64_t x, int64_t y, int64_t *cx, int64_t
 	y = y >= x? y : x;
 	tot = ec[0] + ec[1] + ec[2] + ec[3] + ec[4] + ec[5];
 	if (tot == 0) return;
-	if (x <= (tot - y) + (tot>>3)) {
+	if (rle_ck_n(len) || x <= (tot - y) + (tot>>3)) { // with checkpoints, always go forward from the closest one
 		int c = 0;
-		int64_t l, z = 0;
-		memset(cnt, 0, 48);
-		p = block + 2;
+		int64_t l, z;
+		const uint8_t *end = block + 2 + *(const uint16_t*)block;
+		const uint8_t *nx;
+		p = nx = block + 2 + rle_ck_seek(block, len, x, cnt, &z);
 		while (z < x) {
+			rle_skip_fwd(p, end, z, x, cnt, nx);
 			rle_dec1(p, c, l);
 			z += l; cnt[c] += l;
 		}
 		for (a = 0; a != 6; ++a) cx[a] += cnt[a];
 		cx[c] -= z - x;
 		if (cy) {
+			if (rle_ck_n(len)) {
+				int64_t cky[6], zy;
+				int o = rle_ck_seek(block, len, y, cky, &zy);
+				if (zy > z) p = block + 2 + o, z = zy, memcpy(cnt, cky, 48);
+			}
+			nx = p;
 			while (z < y) {
+				rle_skip_fwd(p, end, z, y, cnt, nx);
 				rle_dec1(p, c, l);
 				z += l; cnt[c] += l;
 			}
@@ -162,6 +373,7 @@ void rle_rank2a(const uint8_t *block, int64_t x, int64_t y, int64_t *cx, int64_t
 	} else {
 #define move_backward(_x) \
 		while (z >= (_x)) { \
+			if (t == 0) rle_skip_bwd(p, block + 2, z, (_x), cnt, nx); \
 			--p; \
 			if (*p>>6 != 2) { \
 				l |= *p>>7? (int64_t)rle_auxtab[*p>>3&7]>>4 << t : *p>>3; \
@@ -175,12 +387,14 @@ void rle_rank2a(const uint8_t *block, int64_t x, int64_t y, int64_t *cx, int64_t
 
 		int t = 0;
 		int64_t l = 0, z = tot;
+		const uint8_t *nx;
 		memcpy(cnt, ec, 48);
-		p = block + 2 + *(const uint16_t*)block;
+		p = nx = block + 2 + *(const uint16_t*)block;
 		if (cy) {
 			move_backward(y)
 			for (a = 0; a != 6; ++a) cy[a] += cnt[a];
 			cy[*p&7] += y - z;
+			nx = p;
 		}
 		move_backward(x)
 		for (a = 0; a != 6; ++a) cx[a] += cnt[a];
@@ -189,3 +403,41 @@ void rle_rank2a(const uint8_t *block, int64_t x, int64_t y, int64_t *cx, int64_t
 #undef move_backward
 	}
 }
+
+void rle_rank1a_cached(const uint8_t *block, int len, int64_t x, int64_t *cx, const int64_t ec[6], int *beg, int64_t bc[6])
+{
+	const uint8_t *p, *q, *nx, *end = block + 2 + *rle_nptr(block);
+	int64_t tot, beg_l, z, l = 0, cnt[6];
+	int a, c = 0;
+
+	tot = ec[0] + ec[1] + ec[2] + ec[3] + ec[4] + ec[5];
+	if (tot == 0) return;
+	beg_l = bc[0] + bc[1] + bc[2] + bc[3] + bc[4] + bc[5];
+	if (x < beg_l) {
+		beg_l = 0, *beg = 0;
+		memset(bc, 0, 48);
+	}
+	if (rle_ck_n(len) && x - beg_l > RLE_CK_STEP) { // start from the closest checkpoint if the cached position is far behind
+		int64_t ckc[6], ckz;
+		int o = rle_ck_seek(block, len, x, ckc, &ckz);
+		if (ckz > beg_l) beg_l = ckz, *beg = o, memcpy(bc, ckc, 48);
+	} else if (rle_ck_n(len) == 0 && x - beg_l > 2 * (tot - x) + (tot>>3)) { // faster from the end; keep the cache
+		rle_rank1a(block, len, x, cx, ec);
+		return;
+	}
+	p = q = nx = block + 2 + *beg, z = beg_l;
+	memcpy(cnt, bc, 48);
+	while (z < x) {
+		rle_skip_fwd(p, end, z, x, cnt, nx);
+		q = p; // the start of the run being decoded
+		rle_dec1(p, c, l);
+		z += l; cnt[c] += l;
+	}
+	for (a = 0; a != 6; ++a) cx[a] += cnt[a];
+	cx[c] -= z - x;
+	if (z > beg_l) { // cache the start of the run containing $x
+		*beg = q - (block + 2);
+		memcpy(bc, cnt, 48);
+		bc[c] -= l;
+	}
+}
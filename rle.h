@@ -13,12 +13,32 @@
 extern "C" {
 #endif
 
-	int rle_insert_cached(uint8_t *block, int64_t x, int a, int64_t rl, int64_t cnt[6], const int64_t ec[6], int *beg, int64_t bc[6]);
-	int rle_insert(uint8_t *block, int64_t x, int a, int64_t rl, int64_t cnt[6], const int64_t end_cnt[6]);
+	// $len is the size of the memory allocated to $block; blocks of RLE_CK_MIN_LEN bytes or longer keep checkpoints at the end
+	int rle_insert_cached(uint8_t *block, int len, int64_t x, int a, int64_t rl, int64_t cnt[6], const int64_t ec[6], int *beg, int64_t bc[6]);
+	int rle_insert(uint8_t *block, int len, int64_t x, int a, int64_t rl, int64_t cnt[6], const int64_t end_cnt[6]);
 	void rle_split(uint8_t *block, uint8_t *new_block);
 	void rle_count(const uint8_t *block, int64_t cnt[6]);
-	void rle_rank2a(const uint8_t *block, int64_t x, int64_t y, int64_t *cx, int64_t *cy, const int64_t ec[6]);
-	#define rle_rank1a(block, x, cx, ec) rle_rank2a(block, x, -1, cx, 0, ec)
+	void rle_rank2a(const uint8_t *block, int len, int64_t x, int64_t y, int64_t *cx, int64_t *cy, const int64_t ec[6]);
+	#define rle_rank1a(block, len, x, cx, ec) rle_rank2a(block, len, x, -1, cx, 0, ec)
+
+	/**
+	 * Compute rle_rank1a(), decoding forward from a cached run
+	 *
+	 * The cache is the byte offset of a run after the 2 counting bytes, $beg,
+	 * and the counts before it, $bc. It is used if the run is at or before
+	 * $x, and is then moved to the run containing $x, so a series of
+	 * increasing positions in one block is decoded in one pass. Set $beg and
+	 * $bc to 0 before the first call on a block.
+	 */
+	void rle_rank1a_cached(const uint8_t *block, int len, int64_t x, int64_t *cx, const int64_t ec[6], int *beg, int64_t bc[6]);
+
+	/**
+	 * Recompute the checkpoints of a block
+	 *
+	 * This must be called after the runs in a block with checkpoints are
+	 * written by means other than rle_insert().
+	 */
+	void rle_ck_build(uint8_t *block, int len);
 
 	void rle_print(const uint8_t *block, int expand);
 
@@ -35,6 +55,24 @@ extern const uint8_t rle_auxtab[8];
 #define RLE_MIN_SPACE 18
 #define rle_nptr(block) ((uint16_t*)(block))
 
+/*******************
+ *** Checkpoints ***
+ *******************/
+
+// A checkpoint is the byte offset of a run in the block and the cumulative counts before it. Checkpoints are placed
+// about every RLE_CK_STEP bytes when a block is built or split, and are shifted along with the runs on insertion.
+// They live at the end of the block: uint32_t counts[n][6] followed by uint16_t offsets[n].
+
+#define RLE_CK_STEP    256
+#define RLE_CK_BYTES   26
+#define RLE_CK_MIN_LEN 1024
+#define RLE_CK_NONE    0xffff // offset of an invalid checkpoint, whose counts do not fit 32 bits
+
+#define rle_ck_n(len) ((len) >= RLE_CK_MIN_LEN? (len) / (RLE_CK_STEP + RLE_CK_BYTES) : 0)
+#define rle_ck_size(len) ((rle_ck_n(len) * RLE_CK_BYTES + 7) >> 3 << 3) // bytes taken by checkpoints
+#define rle_ck_cnt(block, len) ((uint32_t*)((block) + (len) - rle_ck_size(len)))
+#define rle_ck_off(block, len) ((uint16_t*)(rle_ck_cnt(block, len) + rle_ck_n(len) * 6))
+
 // decode one run (c,l) and move the pointer p
 #define rle_dec1(p, c, l) do { \
 		(c) = *(p) & 7; \
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <zlib.h>
+#include <sys/mman.h>
 #include "rle.h"
 #include "rope.h"
 
@@ -10,12 +11,16 @@
  *** Memory Pool ***
  *******************/
 
-#define MP_CHUNK_SIZE 0x100000 // 1MB per chunk
+#define MP_CHUNK_SIZE 0x100000   // 1MB per chunk
+#define MP_HUGE_SIZE  0x200000   // 2MB per chunk with ROPE_MEM_HUGE
+#define MP_HUGE1G_SIZE 0x40000000 // 1GB per chunk with ROPE_MEM_HUGE1G
+#define MP_ALIGN      64       // chunks start at a cache line; a 64-byte rpnode_t then never straddles two lines
 
 typedef struct { // memory pool for fast and compact memory allocation (no free)
-	int size, i, n_elems;
-	int64_t top, max;
+	int size, i, n_elems, mode;
+	int64_t top, max, n_alloc;
 	uint8_t **mem;
+	int64_t *mmap_size; // size of each mmap()'ed chunk, or 0 if the chunk is from posix_memalign()
 } mempool_t;
 
 static mempool_t *mp_init(int size)
@@ -31,23 +36,79 @@ static mempool_t *mp_init(int size)
 static void mp_destroy(mempool_t *mp)
 {
 	int64_t i;
-	for (i = 0; i <= mp->top; ++i) free(mp->mem[i]);
-	free(mp->mem); free(mp);
+	for (i = 0; i <= mp->top; ++i)
+		if (mp->mmap_size[i]) munmap(mp->mem[i], mp->mmap_size[i]);
+		else free(mp->mem[i]);
+	free(mp->mem); free(mp->mmap_size); free(mp);
+}
+
+static void *mp_mmap_huge(int64_t size, int mode)
+{ // mmap() a chunk at a huge page boundary; $size is a multiple of 2MB. Return NULL on failure
+	uint8_t *p, *q;
+	int64_t pre;
+#ifdef MAP_HUGETLB
+	if (mode & ROPE_MEM_HUGE1G) { // explicit 1GB pages; only available if reserved by the administrator
+#ifdef MAP_HUGE_1GB
+		p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_HUGE_1GB, -1, 0);
+		if (p != MAP_FAILED) return p;
+#endif
+	}
+	p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0); // reserved 2MB pages
+	if (p != MAP_FAILED) return p;
+#endif
+	// transparent huge pages: over-allocate, trim to a 2MB boundary and advise the kernel
+	p = mmap(0, size + MP_HUGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return 0;
+	q = (uint8_t*)(((uintptr_t)p + MP_HUGE_SIZE - 1) & ~(uintptr_t)(MP_HUGE_SIZE - 1));
+	pre = q - p;
+	if (pre) munmap(p, pre);
+	if (MP_HUGE_SIZE - pre) munmap(q + size, MP_HUGE_SIZE - pre);
+#ifdef MADV_HUGEPAGE
+	madvise(q, size, MADV_HUGEPAGE);
+#endif
+	return q;
 }
 
 static inline void *mp_alloc(mempool_t *mp)
 {
 	if (mp->i == mp->n_elems) {
+		int64_t size = mp->mode & ROPE_MEM_HUGE1G? MP_HUGE1G_SIZE : mp->mode & ROPE_MEM_HUGE? MP_HUGE_SIZE : MP_CHUNK_SIZE;
+		uint8_t *p = 0;
 		if (++mp->top == mp->max) {
 			mp->max = mp->max? mp->max<<1 : 1;
 			mp->mem = realloc(mp->mem, sizeof(void*) * mp->max);
+			mp->mmap_size = realloc(mp->mmap_size, sizeof(int64_t) * mp->max);
+		}
+		if (mp->mode) { // pages are zero-filled and placed on the NUMA node of the thread touching them first
+			p = mp_mmap_huge(size, mp->mode);
+			if (p == 0 && (mp->mode & ROPE_MEM_HUGE1G)) // 1GB of address space is not available; fall back to 2MB chunks
+				mp->mode &= ~ROPE_MEM_HUGE1G, size = MP_HUGE_SIZE, p = mp_mmap_huge(size, mp->mode);
+			if (p == 0) mp->mode = 0, size = MP_CHUNK_SIZE;
+		}
+		mp->mmap_size[mp->top] = p? size : 0;
+		if (p == 0) {
+			if (posix_memalign((void**)&p, MP_ALIGN, size) != 0) abort();
+			memset(p, 0, size);
 		}
-		mp->mem[mp->top] = calloc(mp->n_elems, mp->size);
-		mp->i = 0;
+		mp->mem[mp->top] = p;
+		mp->i = 0, mp->n_elems = size / mp->size;
 	}
+	++mp->n_alloc;
 	return mp->mem[mp->top] + (mp->i++) * mp->size;
 }
 
+static void mp_stat(const mempool_t *mp, rpmemstat_t *s)
+{
+	int64_t i;
+	memset(s, 0, sizeof(rpmemstat_t));
+	s->n_chunks = mp->top + 1;
+	for (i = 0; i <= mp->top; ++i) {
+		s->reserved += mp->mmap_size[i]? mp->mmap_size[i] : MP_CHUNK_SIZE;
+		if (mp->mmap_size[i]) ++s->n_huge;
+	}
+	s->used = mp->n_alloc * mp->size;
+}
+
 /***************
  *** B+ rope ***
  ***************/
@@ -59,6 +120,7 @@ rope_t *rope_init(int max_nodes, int block_len)
 	if (block_len < 32) block_len = 32;
 	rope->max_nodes = (max_nodes+ 1)>>1<<1;
 	rope->block_len = (block_len + 7) >> 3 << 3;
+	rope->ck_len = rle_ck_n(rope->block_len)? rope->block_len : 0;
 	rope->node = mp_init(sizeof(rpnode_t) * rope->max_nodes);
 	rope->leaf = mp_init(rope->block_len);
 	rope->root = mp_alloc(rope->node);
@@ -75,6 +137,29 @@ void rope_destroy(rope_t *rope)
 	free(rope);
 }
 
+void rope_mem_mode(rope_t *rope, int mode)
+{
+	((mempool_t*)rope->node)->mode = ((mempool_t*)rope->leaf)->mode = mode;
+}
+
+void rope_mem_stat(const rope_t *rope, rpmemstat_t *node, rpmemstat_t *leaf)
+{
+	mp_stat((const mempool_t*)rope->node, node);
+	mp_stat((const mempool_t*)rope->leaf, leaf);
+}
+
+double rope_fill(const rope_t *rope, int64_t *n_leaves)
+{
+	rpitr_t itr;
+	const uint8_t *b;
+	int64_t n = 0, used = 0;
+	rope_itr_first(rope, &itr);
+	while ((b = rope_itr_next_block(&itr)) != 0)
+		used += *rle_nptr(b) + 2, ++n;
+	if (n_leaves) *n_leaves = n;
+	return n? (double)used / n / (rope->block_len - rle_ck_size(rope->ck_len)) : 0.;
+}
+
 static inline rpnode_t *split_node(rope_t *rope, rpnode_t *u, rpnode_t *v)
 { // split $v's child. $u is the first node in the bucket. $v and $u are in the same bucket. IMPORTANT: there is always enough room in $u
 	int j, i = v - u;
@@ -86,6 +171,7 @@ static inline rpnode_t *split_node(rope_t *rope, rpnode_t *u, rpnode_t *v)
 		for (j = 0; j < 6; ++j) v->l += v->c[j];
 		rope->root = v;
 	}
+	++rope->n_splits[!u->is_bottom];
 	if (i != u->n - 1) // then make room for a new node
 		memmove(v + 2, v + 1, sizeof(rpnode_t) * (u->n - i - 1));
 	++u->n; w = v + 1;
@@ -94,6 +180,8 @@ static inline rpnode_t *split_node(rope_t *rope, rpnode_t *u, rpnode_t *v)
 	if (u->is_bottom) { // we are at the bottom level; $v->p is a string instead of a node
 		uint8_t *p = (uint8_t*)v->p, *q = (uint8_t*)w->p;
 		rle_split(p, q);
+		rle_ck_build(p, rope->ck_len);
+		rle_ck_build(q, rope->ck_len);
 		rle_count(q, w->c);
 	} else { // $v->p is a node, not a string
 		rpnode_t *p = v->p, *q = w->p; // $v and $w are siblings and thus $p and $q are cousins
@@ -135,18 +223,91 @@ int64_t rope_insert_run(rope_t *rope, int64_t x, int a, int64_t rl, rpcache_t *c
 	rope->c[a] += rl; // $rope->c should be updated after the loop as adding a new root needs the old $rope->c counts
 	if (cache) {
 		if (cache->p != (uint8_t*)p) memset(cache, 0, sizeof(rpcache_t));
-		n_runs = rle_insert_cached((uint8_t*)p, x - y, a, rl, cnt, v->c, &cache->beg, cache->bc);
+		n_runs = rle_insert_cached((uint8_t*)p, rope->ck_len, x - y, a, rl, cnt, v->c, &cache->beg, cache->bc);
 		cache->p = (uint8_t*)p;
-	} else n_runs = rle_insert((uint8_t*)p, x - y, a, rl, cnt, v->c);
+	} else n_runs = rle_insert((uint8_t*)p, rope->ck_len, x - y, a, rl, cnt, v->c);
 	z += cnt[a];
 	v->c[a] += rl; v->l += rl; // this should be after rle_insert(); otherwise rle_insert() won't work
-	if (n_runs + RLE_MIN_SPACE > rope->block_len) {
+	if (n_runs + RLE_MIN_SPACE > rope->block_len - rle_ck_size(rope->ck_len)) {
 		split_node(rope, u, v);
 		if (cache) memset(cache, 0, sizeof(rpcache_t));
 	}
 	return z;
 }
 
+typedef struct {
+	rpnode_t *u, *v; // $u is the first node in the bucket; $v is the node on the path
+	int64_t y, c[6]; // number of symbols and marginal counts before $v
+} rppath_t;
+
+#define rp_add6(c, d) ((c)[0] += (d)[0], (c)[1] += (d)[1], (c)[2] += (d)[2], (c)[3] += (d)[3], (c)[4] += (d)[4], (c)[5] += (d)[5])
+#define rp_sub6(c, d) ((c)[0] -= (d)[0], (c)[1] -= (d)[1], (c)[2] -= (d)[2], (c)[3] -= (d)[3], (c)[4] -= (d)[4], (c)[5] -= (d)[5])
+
+void rope_insert_runs(rope_t *rope, int64_t n, rpins_t *ins, rpcache_t *cache)
+{ // the same as calling rope_insert_run() on each element in turn, but reusing the path from the previous insertion
+	rppath_t pa[ROPE_MAX_DEPTH];
+	int64_t i;
+	int D = 0; // length of the valid path; the path becomes invalid after a split
+	for (i = 0; i < n; ++i) {
+		rpnode_t *u = 0, *v = 0, *p = rope->root;
+		int64_t x = ins[i].x, rl = ins[i].rl, y = 0, cz[6], cnt[6];
+		int a = ins[i].a, d, k, n_runs, is_split = 0;
+		for (d = 0; d < D; ++d) { // find the first level where $x is not routed along the path
+			const rppath_t *q = &pa[d];
+			if (q->y + q->v->l < x || (q->v != q->u && q->y >= x)) break;
+		}
+		for (k = 0; k < d && k < D - 1; ++k) // update the counts of the shared ancestors
+			pa[k].v->c[a] += rl, pa[k].v->l += rl;
+		if (d > 0) { // resume at level $d, or at the bottom if the whole path is reused
+			if (d == D) --d;
+			u = pa[d].u, p = pa[d].v, y = pa[d].y;
+			memcpy(cz, pa[d].c, 48);
+			for (; y + p->l < x; ++p) y += p->l, rp_add6(cz, p->c);
+			while (p != u && y >= x) --p, y -= p->l, rp_sub6(cz, p->c);
+			pa[d].v = p, pa[d].y = y;
+			memcpy(pa[d].c, cz, 48);
+			v = p, p = p->p, ++d;
+		} else memset(cz, 0, 48);
+		if (d == 0 || !u->is_bottom) {
+			do { // top-down update, the same as rope_insert_run() except that all the counts are kept
+				if (p->n == rope->max_nodes) { // node is full; split
+					v = split_node(rope, u, v);
+					is_split = 1;
+					if (y + v->l < x)
+						y += v->l, rp_add6(cz, v->c), ++v, p = v->p;
+				}
+				u = p;
+				if (v && x - y > v->l>>1) {
+					p += p->n - 1; y += v->l; rp_add6(cz, v->c);
+					for (; y >= x; --p) y -= p->l, rp_sub6(cz, p->c);
+					++p;
+				} else for (; y + p->l < x; ++p) y += p->l, rp_add6(cz, p->c);
+				assert(p - u < u->n);
+				if (v) v->c[a] += rl, v->l += rl;
+				pa[d].u = u, pa[d].v = p, pa[d].y = y;
+				memcpy(pa[d].c, cz, 48);
+				++d;
+				v = p; p = p->p;
+			} while (!u->is_bottom);
+		}
+		D = d;
+		rope->c[a] += rl;
+		if (cache) {
+			if (cache->p != (uint8_t*)p) memset(cache, 0, sizeof(rpcache_t));
+			n_runs = rle_insert_cached((uint8_t*)p, rope->ck_len, x - y, a, rl, cnt, v->c, &cache->beg, cache->bc);
+			cache->p = (uint8_t*)p;
+		} else n_runs = rle_insert((uint8_t*)p, rope->ck_len, x - y, a, rl, cnt, v->c);
+		ins[i].z = cz[a] + cnt[a];
+		v->c[a] += rl; v->l += rl;
+		if (n_runs + RLE_MIN_SPACE > rope->block_len - rle_ck_size(rope->ck_len)) {
+			split_node(rope, u, v);
+			is_split = 1;
+			if (cache) memset(cache, 0, sizeof(rpcache_t));
+		}
+		if (is_split) D = 0;
+	}
+}
+
 static rpnode_t *rope_count_to_leaf(const rope_t *rope, int64_t x, int64_t cx[6], int64_t *rest)
 {
 	rpnode_t *u, *v = 0, *p = rope->root;
@@ -182,15 +343,308 @@ void rope_rank2a(const rope_t *rope, int64_t x, int64_t y, int64_t *cx, int64_t
 	int64_t rest;
 	v = rope_count_to_leaf(rope, x, cx, &rest);
 	if (y < x || cy == 0) {
-		rle_rank1a((const uint8_t*)v->p, rest, cx, v->c);
+		rle_rank1a((const uint8_t*)v->p, rope->ck_len, rest, cx, v->c);
 	} else if (rest + (y - x) <= v->l) {
 		memcpy(cy, cx, 48);
-		rle_rank2a((const uint8_t*)v->p, rest, rest + (y - x), cx, cy, v->c);
+		rle_rank2a((const uint8_t*)v->p, rope->ck_len, rest, rest + (y - x), cx, cy, v->c);
 	} else {
-		rle_rank1a((const uint8_t*)v->p, rest, cx, v->c);
+		rle_rank1a((const uint8_t*)v->p, rope->ck_len, rest, cx, v->c);
 		v = rope_count_to_leaf(rope, y, cy, &rest);
-		rle_rank1a((const uint8_t*)v->p, rest, cy, v->c);
+		rle_rank1a((const uint8_t*)v->p, rope->ck_len, rest, cy, v->c);
+	}
+}
+
+static const rpnode_t *rope_path_to_leaf(const rope_t *rope, rppath_t *pa, int *_D, int64_t x, int64_t cx[6], int64_t *rest)
+{ // the same as rope_count_to_leaf() but reuses the path in $pa[0..*_D-1]
+	rpnode_t *u = 0, *v = 0, *p = rope->root;
+	int64_t y = 0;
+	int d, D = *_D;
+	for (d = 0; d < D; ++d) {
+		const rppath_t *q = &pa[d];
+		if (q->y + q->v->l < x || (q->v != q->u && q->y >= x)) break;
+	}
+	if (D > 0) { // resume at level $d
+		if (d == D) --d;
+		u = pa[d].u, p = pa[d].v, y = pa[d].y;
+		memcpy(cx, pa[d].c, 48);
+		for (; y + p->l < x; ++p) y += p->l, rp_add6(cx, p->c);
+		while (p != u && y >= x) --p, y -= p->l, rp_sub6(cx, p->c);
+		pa[d].v = p, pa[d].y = y;
+		memcpy(pa[d].c, cx, 48);
+		v = p, p = p->p, ++d;
+	} else memset(cx, 0, 48);
+	while (u == 0 || !u->is_bottom) {
+		u = p;
+		if (v && x - y > v->l>>1) {
+			p += p->n - 1; y += v->l; rp_add6(cx, v->c);
+			for (; y >= x; --p) y -= p->l, rp_sub6(cx, p->c);
+			++p;
+		} else for (; y + p->l < x; ++p) y += p->l, rp_add6(cx, p->c);
+		pa[d].u = u, pa[d].v = p, pa[d].y = y;
+		memcpy(pa[d].c, cx, 48);
+		++d;
+		v = p; p = p->p;
+	}
+	*_D = d, *rest = x - y;
+	return v;
+}
+
+void rope_rank2a_batch(const rope_t *rope, int64_t n, const int64_t *x, const int64_t *y, int64_t *cx, int64_t *cy)
+{
+	rppath_t pa[ROPE_MAX_DEPTH];
+	const rpnode_t *u = 0; // the leaf the decoding cache is for; sorted positions in a leaf are then decoded in one pass
+	int64_t i, rest, bc[6];
+	int D = 0, beg = 0;
+	for (i = 0; i < n; ++i) {
+		int64_t *cxi = cx + i * 6, *cyi = cy? cy + i * 6 : 0, yi = y? y[i] : -1;
+		const rpnode_t *v;
+		v = rope_path_to_leaf(rope, pa, &D, x[i], cxi, &rest);
+		if (v != u) u = v, beg = 0, memset(bc, 0, 48);
+		if (yi < x[i] || cyi == 0) {
+			rle_rank1a_cached((const uint8_t*)v->p, rope->ck_len, rest, cxi, v->c, &beg, bc);
+		} else if (rest + (yi - x[i]) <= v->l) {
+			memcpy(cyi, cxi, 48);
+			rle_rank1a_cached((const uint8_t*)v->p, rope->ck_len, rest, cxi, v->c, &beg, bc);
+			rle_rank1a_cached((const uint8_t*)v->p, rope->ck_len, rest + (yi - x[i]), cyi, v->c, &beg, bc);
+		} else {
+			rle_rank1a_cached((const uint8_t*)v->p, rope->ck_len, rest, cxi, v->c, &beg, bc);
+			v = rope_path_to_leaf(rope, pa, &D, yi, cyi, &rest);
+			if (v != u) u = v, beg = 0, memset(bc, 0, 48);
+			rle_rank1a_cached((const uint8_t*)v->p, rope->ck_len, rest, cyi, v->c, &beg, bc);
+		}
+	}
+}
+
+/******************
+ *** Compaction ***
+ ******************/
+
+struct rpbuild_s { // build a rope bottom-up from runs given in order
+	mempool_t *node, *leaf;
+	int nf, lim, ck_len; // children per bucket, bytes of runs per leaf, and checkpoint length
+	int64_t n_closed[ROPE_MAX_DEPTH]; // number of finished buckets at each level
+	rpnode_t *lv[ROPE_MAX_DEPTH]; // the bucket being filled at each level
+	uint8_t *b; // the leaf being filled
+	int64_t bc[6]; // counts in $b
+	int c; // the pending run, merged with adjacent runs of the same symbol
+	int64_t l;
+};
+
+static void rb_init(rpbuild_t *rb, const rope_t *rope, double fill) // new pools in the shape and memory mode of $rope
+{
+	int space = rope->block_len - rle_ck_size(rope->ck_len) - RLE_MIN_SPACE - 2;
+	fill = fill < .5? .5 : fill > 1.? 1. : fill;
+	memset(rb, 0, sizeof(rpbuild_t));
+	rb->ck_len = rope->ck_len;
+	rb->node = mp_init(sizeof(rpnode_t) * rope->max_nodes);
+	rb->leaf = mp_init(rope->block_len);
+	rb->node->mode = ((mempool_t*)rope->node)->mode, rb->leaf->mode = ((mempool_t*)rope->leaf)->mode;
+	rb->nf = (int)(rope->max_nodes * fill + .499);
+	rb->nf = rb->nf < 2? 2 : rb->nf;
+	rb->lim = (int)(space * fill + .499);
+	rb->lim = rb->lim < 8? 8 : rb->lim; // room for the longest run
+}
+
+static void rb_add(rpbuild_t *rb, int d, void *p, const int64_t c[6]);
+
+static void rb_close(rpbuild_t *rb, int d) // append the bucket at level $d to its parent
+{
+	rpnode_t *u = rb->lv[d];
+	int64_t c[6];
+	int i;
+	memset(c, 0, 48);
+	for (i = 0; i < u->n; ++i) rp_add6(c, u[i].c);
+	rb->lv[d] = 0, ++rb->n_closed[d];
+	rb_add(rb, d + 1, u, c);
+}
+
+static void rb_add(rpbuild_t *rb, int d, void *p, const int64_t c[6])
+{
+	rpnode_t *u, *v;
+	assert(d < ROPE_MAX_DEPTH);
+	if (rb->lv[d] && rb->lv[d]->n == rb->nf) rb_close(rb, d);
+	if (rb->lv[d] == 0) {
+		u = rb->lv[d] = mp_alloc(rb->node);
+		u->is_bottom = (d == 0), u->n = 0;
+	}
+	u = rb->lv[d], v = u + u->n;
+	v->p = p;
+	memcpy(v->c, c, 48);
+	v->l = c[0] + c[1] + c[2] + c[3] + c[4] + c[5];
+	++u->n;
+}
+
+static void rb_flush(rpbuild_t *rb) // write the pending run
+{
+	uint8_t tmp[8];
+	uint16_t *nptr;
+	int n;
+	if (rb->l == 0) return;
+	n = rle_enc1(tmp, rb->c, rb->l);
+	if (rb->b && *rle_nptr(rb->b) + n > rb->lim) { // the leaf is full
+		if (rb->ck_len) rle_ck_build(rb->b, rb->ck_len);
+		rb_add(rb, 0, rb->b, rb->bc);
+		rb->b = 0;
+	}
+	if (rb->b == 0) rb->b = mp_alloc(rb->leaf), memset(rb->bc, 0, 48);
+	nptr = rle_nptr(rb->b);
+	memcpy(rb->b + 2 + *nptr, tmp, n);
+	*nptr += n, rb->bc[rb->c] += rb->l;
+	rb->l = 0;
+}
+
+static inline void rb_run(rpbuild_t *rb, int c, int64_t l) // append $l symbols $c
+{
+	if (c != rb->c || rb->l + l >= 1LL<<43) rb_flush(rb), rb->c = c; // 43 bits is the longest run rle_enc1() encodes
+	rb->l += l;
+}
+
+static rpnode_t *rb_finish(rpbuild_t *rb) // return the root
+{
+	int d;
+	rb_flush(rb);
+	if (rb->b == 0) rb->b = mp_alloc(rb->leaf); // keep one empty leaf in an empty rope
+	if (rb->ck_len) rle_ck_build(rb->b, rb->ck_len);
+	rb_add(rb, 0, rb->b, rb->bc);
+	for (d = 0; rb->n_closed[d] > 0; ++d) // close the unfinished buckets until a level has a single bucket
+		rb_close(rb, d);
+	return rb->lv[d];
+}
+
+static rpnode_t *rb_copy(rpbuild_t *rb, const rope_t *rope) // re-encode all runs of $rope; return the new root
+{
+	rpitr_t itr;
+	const uint8_t *b;
+	rope_itr_first(rope, &itr);
+	while ((b = rope_itr_next_block(&itr)) != 0) { // re-encode the runs in order
+		const uint8_t *q = b + 2, *end = b + 2 + *rle_nptr(b);
+		while (q < end) {
+			int c = 0;
+			int64_t l;
+			rle_dec1(q, c, l);
+			rb_run(rb, c, l);
+		}
+	}
+	return rb_finish(rb);
+}
+
+void rope_compact(rope_t *rope, double fill)
+{
+	rpbuild_t rb;
+	rpnode_t *root;
+	rb_init(&rb, rope, fill);
+	root = rb_copy(&rb, rope);
+	mp_destroy(rope->node); mp_destroy(rope->leaf);
+	rope->node = rb.node, rope->leaf = rb.leaf;
+	rope->root = root;
+}
+
+rpbuild_t *rope_build_init(const rope_t *rope, double fill)
+{
+	rpbuild_t *rb;
+	rb = malloc(sizeof(rpbuild_t));
+	rb_init(rb, rope, fill);
+	return rb;
+}
+
+void rope_build_run(rpbuild_t *rb, int c, int64_t l)
+{
+	if (l > 0) rb_run(rb, c, l);
+}
+
+void rope_build_finish(rpbuild_t *rb, rope_t *rope)
+{
+	rpnode_t *root;
+	int i;
+	root = rb_finish(rb);
+	mp_destroy(rope->node); mp_destroy(rope->leaf);
+	rope->node = rb->node, rope->leaf = rb->leaf;
+	rope->root = root;
+	memset(rope->c, 0, 48);
+	for (i = 0; i < root->n; ++i) rp_add6(rope->c, root[i].c);
+	free(rb);
+}
+
+rope_t *rope_dup(const rope_t *rope, double fill)
+{
+	rope_t *r;
+	rpbuild_t rb;
+	r = calloc(1, sizeof(rope_t));
+	r->max_nodes = rope->max_nodes, r->block_len = rope->block_len, r->ck_len = rope->ck_len;
+	memcpy(r->c, rope->c, 48);
+	rb_init(&rb, rope, fill);
+	r->root = rb_copy(&rb, rope);
+	r->node = rb.node, r->leaf = rb.leaf;
+	return r;
+}
+
+/***************
+ *** Merging ***
+ ***************/
+
+typedef struct { // read the runs of a rope in order
+	rpitr_t itr;
+	const uint8_t *q, *end;
+	int c;
+	int64_t l; // symbols left in the current run
+} rprun_t;
+
+static inline void rr_next(rprun_t *r)
+{
+	while (r->q == r->end) {
+		const uint8_t *b = rope_itr_next_block(&r->itr);
+		assert(b); // the bit vector asks for more symbols than the rope has
+		r->q = b + 2, r->end = b + 2 + *rle_nptr(b);
 	}
+	r->c = 0;
+	rle_dec1(r->q, r->c, r->l);
+}
+
+static inline int64_t bv_run(const uint64_t *bits, int64_t x, int64_t end, int v) // number of bits equal to $v from $x, up to $end
+{
+	int64_t y = x;
+	while (y < end) {
+		uint64_t w = (v? ~bits[y>>6] : bits[y>>6]) >> (y&63); // set bits are those not equal to $v
+		if (w) {
+			y += __builtin_ctzll(w);
+			break;
+		}
+		y += 64 - (y&63);
+	}
+	return (y < end? y : end) - x;
+}
+
+rope_t *rope_merge(const rope_t *a, const rope_t *b, const uint64_t *bits, int64_t off, double fill)
+{
+	rope_t *r;
+	rpbuild_t rb;
+	rprun_t rr[2];
+	int64_t i, n, k, end;
+	int v;
+
+	r = calloc(1, sizeof(rope_t));
+	r->max_nodes = a->max_nodes, r->block_len = a->block_len, r->ck_len = a->ck_len;
+	for (v = 0; v < 6; ++v) r->c[v] = a->c[v] + b->c[v];
+	memset(rr, 0, sizeof(rprun_t) * 2);
+	rope_itr_first(a, &rr[0].itr);
+	rope_itr_first(b, &rr[1].itr);
+	rb_init(&rb, a, fill);
+	end = off + r->c[0] + r->c[1] + r->c[2] + r->c[3] + r->c[4] + r->c[5];
+	for (i = off; i < end; i += n) { // take a stretch of equal bits from the rope the bits point to
+		rprun_t *p;
+		v = bits[i>>6] >> (i&63) & 1;
+		n = bv_run(bits, i, end, v);
+		for (p = &rr[v], k = n; k > 0;) {
+			int64_t t;
+			if (p->l == 0) rr_next(p);
+			t = p->l < k? p->l : k;
+			rb_run(&rb, p->c, t);
+			p->l -= t, k -= t;
+		}
+	}
+	r->root = rb_finish(&rb);
+	r->node = rb.node, r->leaf = rb.leaf;
+	return r;
 }
 
 /*********************
@@ -274,7 +728,7 @@ void rope_dump(const rope_t *r, FILE *fp)
 	rope_dump_node(r->root, fp);
 }
 
-rpnode_t *rope_restore_node(const rope_t *r, FILE *fp, int64_t c[6])
+rpnode_t *rope_restore_node(rope_t *r, FILE *fp, int64_t c[6])
 {
 	uint8_t is_bottom, a;
 	int16_t i, n;
@@ -291,6 +745,7 @@ rpnode_t *rope_restore_node(const rope_t *r, FILE *fp, int64_t c[6])
 			fread(p[i].c, 8, 6, fp);
 			fread(q, 2, 1, fp);
 			fread(q + 1, 1, *q, fp);
+			if (*q + 2 > r->block_len - rle_ck_size(r->block_len)) r->ck_len = -1; // written without checkpoints; no room for them
 		}
 	} else {
 		for (i = 0; i < n; ++i)
@@ -314,5 +769,122 @@ rope_t *rope_restore(FILE *fp)
 	r->node = mp_init(sizeof(rpnode_t) * r->max_nodes);
 	r->leaf = mp_init(r->block_len);
 	r->root = rope_restore_node(r, fp, r->c);
+	if (r->ck_len == 0 && rle_ck_n(r->block_len)) { // build checkpoints
+		rpitr_t itr;
+		const uint8_t *b;
+		r->ck_len = r->block_len;
+		rope_itr_first(r, &itr);
+		while ((b = rope_itr_next_block(&itr)) != 0)
+			rle_ck_build((uint8_t*)b, r->ck_len);
+	} else r->ck_len = 0;
+	return r;
+}
+
+/*******************************
+ *** Memory-mappable dumping ***
+ *******************************/
+
+// A rope in the mmap-able format: a header, then all buckets in breadth-first order, each taking
+// $max_nodes*sizeof(rpnode_t) bytes, then all leaves in order, each taking $block_len bytes. Pointers are
+// written as offsets from the start of the file. The two regions start at page boundaries.
+
+#define RP_MM_PAGE 4096
+
+typedef struct {
+	int32_t max_nodes, block_len, ck_len, dummy;
+	int64_t c[6];
+	int64_t n_buckets, n_leaves, node_off, leaf_off, end;
+	int64_t pad[3]; // 128 bytes in total
+} rpmmhdr_t;
+
+static void rp_mm_pad(FILE *fp, int64_t *off, int64_t align)
+{
+	static const uint8_t zero[RP_MM_PAGE];
+	int64_t n = (align - *off % align) % align;
+	fwrite(zero, 1, n, fp);
+	*off += n;
+}
+
+void rope_dump_mmap(const rope_t *r, FILE *fp, int64_t *off)
+{
+	rpmmhdr_t h;
+	const rpnode_t **b = 0;
+	size_t bsize = sizeof(rpnode_t) * r->max_nodes;
+	rpnode_t *tmp;
+	int64_t i, n = 0, m = 256, n_child = 1, n_leaf = 0;
+	int j;
+
+	memset(&h, 0, sizeof(rpmmhdr_t));
+	b = malloc(m * sizeof(void*));
+	b[n++] = r->root;
+	for (i = 0; i < n; ++i) { // collect buckets in the breadth-first order
+		const rpnode_t *u = b[i];
+		if (u->is_bottom) {
+			h.n_leaves += u->n;
+			continue;
+		}
+		for (j = 0; j < u->n; ++j) {
+			if (n == m) m <<= 1, b = realloc(b, m * sizeof(void*));
+			b[n++] = u[j].p;
+		}
+	}
+	h.max_nodes = r->max_nodes, h.block_len = r->block_len, h.ck_len = r->ck_len;
+	memcpy(h.c, r->c, 48);
+	h.n_buckets = n;
+	h.node_off = (*off + sizeof(rpmmhdr_t) + RP_MM_PAGE - 1) / RP_MM_PAGE * RP_MM_PAGE;
+	h.leaf_off = (h.node_off + n * bsize + RP_MM_PAGE - 1) / RP_MM_PAGE * RP_MM_PAGE;
+	h.end = h.leaf_off + h.n_leaves * r->block_len;
+	fwrite(&h, sizeof(rpmmhdr_t), 1, fp);
+	*off += sizeof(rpmmhdr_t);
+	rp_mm_pad(fp, off, RP_MM_PAGE);
+
+	tmp = malloc(bsize);
+	for (i = 0; i < n; ++i) { // children of the i-th bucket are the next buckets or leaves in order
+		memcpy(tmp, b[i], bsize);
+		for (j = 0; j < b[i]->n; ++j)
+			tmp[j].p = (rpnode_t*)(intptr_t)(b[i]->is_bottom? h.leaf_off + (n_leaf++) * r->block_len : h.node_off + (n_child++) * bsize);
+		fwrite(tmp, 1, bsize, fp);
+	}
+	*off += n * bsize;
+	free(tmp);
+	rp_mm_pad(fp, off, RP_MM_PAGE);
+	for (i = 0; i < n; ++i)
+		if (b[i]->is_bottom)
+			for (j = 0; j < b[i]->n; ++j)
+				fwrite(b[i][j].p, 1, r->block_len, fp);
+	*off += h.n_leaves * r->block_len;
+	free(b);
+}
+
+rope_t *rope_restore_mmap(uint8_t *base, int64_t size, int64_t *off)
+{
+	rpmmhdr_t *h = (rpmmhdr_t*)(base + *off);
+	rope_t *r;
+	size_t bsize;
+	int64_t i;
+	int j;
+
+	if (*off + (int64_t)sizeof(rpmmhdr_t) > size || h->max_nodes < 2 || h->max_nodes > 511 || h->block_len < 32) return 0;
+	bsize = sizeof(rpnode_t) * h->max_nodes;
+	if (h->node_off < *off || h->leaf_off < h->node_off + h->n_buckets * (int64_t)bsize || h->end != h->leaf_off + h->n_leaves * h->block_len || h->end > size)
+		return 0;
+	for (i = 0; i < h->n_buckets; ++i) { // turn offsets into pointers; this only writes to the bucket pages
+		rpnode_t *u = (rpnode_t*)(base + h->node_off + i * bsize);
+		int64_t lo = u->is_bottom? h->leaf_off : h->node_off, hi = u->is_bottom? h->end : h->leaf_off;
+		int64_t step = u->is_bottom? h->block_len : bsize;
+		if (u->n > h->max_nodes) return 0;
+		for (j = 0; j < u->n; ++j) {
+			int64_t x = (intptr_t)u[j].p;
+			if (x < lo || x >= hi || (x - lo) % step != 0) return 0;
+			u[j].p = (rpnode_t*)(base + x);
+		}
+	}
+	r = calloc(1, sizeof(rope_t));
+	r->max_nodes = h->max_nodes, r->block_len = h->block_len, r->ck_len = h->ck_len;
+	memcpy(r->c, h->c, 48);
+	r->node = mp_init(bsize);
+	r->leaf = mp_init(r->block_len);
+	r->root = (rpnode_t*)(base + h->node_off);
+	*off = h->end;
 	return r;
 }
@@ -8,6 +8,9 @@
 #define ROPE_DEF_MAX_NODES 64
 #define ROPE_DEF_BLOCK_LEN 512
 
+#define ROPE_MEM_HUGE   0x1 // allocate the memory pools in 2MB chunks backed by huge pages
+#define ROPE_MEM_HUGE1G 0x2 // allocate 1GB chunks, using 1GB pages if the kernel has reserved them
+
 typedef struct rpnode_s {
 	struct rpnode_s *p; // child; at the bottom level, $p points to a string with the first 2 bytes giving the number of runs (#runs)
 	uint64_t l:54, n:9, is_bottom:1; // $n and $is_bottom are only set for the first node in a bucket
@@ -16,7 +19,9 @@ typedef struct rpnode_s {
 
 typedef struct {
 	int32_t max_nodes, block_len; // both MUST BE even numbers
+	int32_t ck_len; // $block_len if leaves keep checkpoints (see rle.h), or 0
 	int64_t c[6]; // marginal counts
+	int64_t n_splits[2]; // numbers of leaf and internal node splits since rope_init()
 	rpnode_t *root;
 	void *node, *leaf; // memory pool
 } rope_t;
@@ -34,22 +39,171 @@ typedef struct {
 	uint8_t *p;
 } rpcache_t;
 
+typedef struct {
+	int64_t n_chunks, n_huge; // number of chunks, and of those mmap()'ed for huge pages
+	int64_t reserved, used; // bytes in the chunks, and bytes handed out
+} rpmemstat_t;
+
+struct rpbuild_s;
+typedef struct rpbuild_s rpbuild_t; // bottom-up construction; see rope_build_init()
+
+typedef struct {
+	int64_t x, rl; // insert $rl symbols $a after $x symbols
+	int a;
+	int64_t z; // output: rank(a, x) before the insertion
+} rpins_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 	rope_t *rope_init(int max_nodes, int block_len);
 	void rope_destroy(rope_t *rope);
+
+	/**
+	 * Set how the memory pools allocate chunks from now on
+	 *
+	 * With ROPE_MEM_HUGE, chunks are mmap()'ed at 2MB boundaries, from the
+	 * reserved huge pages if there are any, or else advised for transparent
+	 * huge pages. Pages are populated lazily, so they are placed on the NUMA
+	 * node of the thread that first writes to them. Memory already allocated
+	 * is not moved.
+	 *
+	 * @param rope    rope
+	 * @param mode    0 or bitwise OR of ROPE_MEM_* macros
+	 */
+	void rope_mem_mode(rope_t *rope, int mode);
+	void rope_mem_stat(const rope_t *rope, rpmemstat_t *node, rpmemstat_t *leaf);
+
+	/**
+	 * Compute how full the leaves are
+	 *
+	 * This visits every leaf, so it takes about as long as rope_rank2a() on as
+	 * many positions.
+	 *
+	 * @param rope      rope
+	 * @param n_leaves  (out) number of leaves; can be NULL
+	 *
+	 * @return bytes taken by runs over the space for runs in all leaves; 0 if there are no leaves
+	 */
+	double rope_fill(const rope_t *rope, int64_t *n_leaves);
 	int64_t rope_insert_run(rope_t *rope, int64_t x, int a, int64_t rl, rpcache_t *cache);
+
+	/**
+	 * Insert runs one after another
+	 *
+	 * This is equivalent to calling rope_insert_run() on each element of $ins
+	 * in turn. The descent path is reused between insertions, which is fastest
+	 * when positions are close or increasing. Positions are those after all
+	 * the preceding insertions in $ins.
+	 *
+	 * @param rope    rope
+	 * @param n       number of runs
+	 * @param ins     runs to insert; $ins[i].z is set on return
+	 * @param cache   leaf cache; can be NULL
+	 */
+	void rope_insert_runs(rope_t *rope, int64_t n, rpins_t *ins, rpcache_t *cache);
 	void rope_rank2a(const rope_t *rope, int64_t x, int64_t y, int64_t *cx, int64_t *cy);
 	#define rope_rank1a(rope, x, cx) rope_rank2a(rope, x, -1, cx, 0)
 
+	/**
+	 * Compute rope_rank2a() for multiple intervals
+	 *
+	 * The path to the leaf is shared between consecutive queries; it is the
+	 * fastest when the queries are sorted.
+	 *
+	 * @param rope    rope
+	 * @param n       number of queries
+	 * @param x       start of each interval
+	 * @param y       end of each interval; NULL to compute rope_rank1a() only
+	 * @param cx      (out) rank(a, x[i]) for all symbols, at cx[i*6+a]
+	 * @param cy      (out) rank(a, y[i]), at cy[i*6+a]; can be NULL if y is NULL
+	 */
+	void rope_rank2a_batch(const rope_t *rope, int64_t n, const int64_t *x, const int64_t *y, int64_t *cx, int64_t *cy);
+
+	/**
+	 * Rebuild the rope with densely packed leaves and internal nodes
+	 *
+	 * Runs are re-encoded in order, merging equal runs across leaf
+	 * boundaries, into leaves and buckets filled to fraction $fill of their
+	 * capacity. The old memory pools are freed and returned to the system.
+	 * Peak memory is that of the old and the new rope together.
+	 *
+	 * @param rope    rope
+	 * @param fill    fill factor in [0.5,1]; 1 is the most compact, but the next insertion into each leaf splits it
+	 */
+	void rope_compact(rope_t *rope, double fill);
+
+	/**
+	 * Copy a rope into new memory pools, packed as by rope_compact()
+	 *
+	 * @param rope    rope; only read
+	 * @param fill    fill factor as in rope_compact()
+	 *
+	 * @return the copy, which shares nothing with $rope
+	 */
+	rope_t *rope_dup(const rope_t *rope, double fill);
+
+	/**
+	 * Start building a rope from its runs, given in order
+	 *
+	 * Runs are appended with rope_build_run() and packed as by rope_compact();
+	 * rope_build_finish() then replaces the content of $rope, which is
+	 * otherwise not read or changed in between.
+	 *
+	 * @param rope    rope giving the shape and memory mode
+	 * @param fill    fill factor as in rope_compact()
+	 */
+	rpbuild_t *rope_build_init(const rope_t *rope, double fill);
+	void rope_build_run(rpbuild_t *rb, int c, int64_t l);
+	void rope_build_finish(rpbuild_t *rb, rope_t *rope); // frees $rb
+
+	/**
+	 * Interleave two ropes into a new one
+	 *
+	 * The i-th symbol of the new rope is the next unused symbol of $b if bit
+	 * $off+i of $bits is set, or of $a otherwise. Both ropes are read once in
+	 * order, and the new rope is packed as by rope_compact().
+	 *
+	 * @param a       rope; the new rope takes its shape and memory mode
+	 * @param b       rope
+	 * @param bits    bit vector; bit x is at (bits[x>>6]>>(x&63)&1)
+	 * @param off     position of the first symbol in $bits
+	 * @param fill    fill factor as in rope_compact()
+	 *
+	 * @return the new rope; $a and $b are not changed
+	 */
+	rope_t *rope_merge(const rope_t *a, const rope_t *b, const uint64_t *bits, int64_t off, double fill);
+
 	void rope_itr_first(const rope_t *rope, rpitr_t *i);
 	const uint8_t *rope_itr_next_block(rpitr_t *i);
 
 	void rope_print_node(const rpnode_t *p);
 	void rope_dump(const rope_t *r, FILE *fp);
 	rope_t *rope_restore(FILE *fp);
+
+	/**
+	 * Dump a rope in the memory-mappable format
+	 *
+	 * @param r       rope
+	 * @param fp      output; need not be seekable
+	 * @param off     (in/out) number of bytes written to $fp so far
+	 */
+	void rope_dump_mmap(const rope_t *r, FILE *fp, int64_t *off);
+
+	/**
+	 * Use a rope dumped by rope_dump_mmap() in place
+	 *
+	 * Offsets in the buckets are turned into pointers, so $base must be
+	 * writable; leaves are not touched. $base must outlive the rope.
+	 *
+	 * @param base    start of the file in memory
+	 * @param size    size of the file
+	 * @param off     (in/out) offset of the rope in the file; set to its end on return
+	 *
+	 * @return the rope, or NULL if the data is malformed
+	 */
+	rope_t *rope_restore_mmap(uint8_t *base, int64_t size, int64_t *off);
 	
 #ifdef __cplusplus
 }